@@ -0,0 +1,407 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+#include "V2DeviceClient.h"
+#include <alsa/asoundlib.h>
+#include <atomic>
+#include <chrono>
+#include <poll.h>
+
+namespace V2DeviceHost {
+std::string Client::hash(const uint8_t* data, size_t size) {
+  return hashSHA1(data, size);
+}
+
+bool Client::request(JsonObjectConst request, JsonDocument& reply, uint32_t timeoutMs) {
+  return this->request(request, nullptr, 0, reply, timeoutMs);
+}
+
+bool Client::request(JsonObjectConst request,
+                     const uint8_t*  data,
+                     size_t          size,
+                     JsonDocument&   reply,
+                     uint32_t        timeoutMs) {
+  const bool sysex8 = _transport->isSysEx8();
+
+  JsonDocument json;
+  JsonObject   jsonDevice = json["com.versioduo.device"].to<JsonObject>();
+  jsonDevice.set(request);
+  if (_token > 0)
+    jsonDevice["token"] = _token;
+
+  std::string text;
+  serializeJson(json, text);
+
+  // 0x7d == SysEx research/private ID
+  std::vector<uint8_t> message;
+  if (sysex8) {
+    message.reserve(text.size() + size + 2);
+    message.push_back(0x7d);
+    message.insert(message.end(), text.begin(), text.end());
+    if (data) {
+      message.push_back('\0');
+      message.insert(message.end(), data, data + size);
+    }
+
+  } else {
+    text = escapeJSON(text);
+    message.reserve(text.size() + 3);
+    message.push_back(0xf0);
+    message.push_back(0x7d);
+    message.insert(message.end(), text.begin(), text.end());
+    message.push_back(0xf7);
+  }
+
+  if (!_transport->send(message)) {
+    _error = "sendFailed";
+    return false;
+  }
+
+  const auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+  for (;;) {
+    const auto now = std::chrono::steady_clock::now();
+    if (now >= end)
+      break;
+
+    const uint32_t msec = std::chrono::duration_cast<std::chrono::milliseconds>(end - now).count();
+    if (!_transport->receive(message, msec))
+      break;
+
+    // The text of an 8-bit message has no framing.
+    const size_t start = sysex8 ? 1 : 2;
+    const size_t end   = sysex8 ? message.size() : message.size() - 1;
+    if (message.size() < start + 2 || message[start - 1] != 0x7d || message[start] != '{')
+      continue;
+
+    if (deserializeJson(reply, (const char*)message.data() + start, end - start))
+      continue;
+
+    JsonObject jsonReply = reply["com.versioduo.device"];
+    if (!jsonReply)
+      continue;
+
+    _replySize = message.size();
+
+    if (!jsonReply["token"].isNull()) {
+      const uint32_t token = jsonReply["token"];
+      if (_token > 0 && token != _token)
+        continue;
+
+      _token = token;
+    }
+
+    // The device drops requests which exceed its rate limits.
+    if (jsonReply["status"] == "busy") {
+      _error = "busy";
+      return false;
+    }
+
+    return true;
+  }
+
+  _error = "timeout";
+  return false;
+}
+
+bool Client::getAll(JsonDocument& reply) {
+  JsonDocument json;
+  json["method"] = "getAll";
+  return request(json.as<JsonObjectConst>(), reply);
+}
+
+bool Client::checkReplyBudget(JsonDocument& report) {
+  JsonDocument json;
+  json["method"] = "getAll";
+  json["report"] = true;
+
+  JsonDocument reply;
+  if (!request(json.as<JsonObjectConst>(), reply))
+    return false;
+
+  JsonObject jsonReply = reply["com.versioduo.device"]["system"]["reply"];
+  if (!jsonReply) {
+    setError("noReplyReport");
+    return false;
+  }
+
+  report = jsonReply;
+  if (jsonReply["warning"] | false) {
+    setError(jsonReply["overflow"] | false ? "replyOverflow" : "replyOverBudget");
+    return false;
+  }
+
+  return true;
+}
+
+bool Client::writeConfiguration(JsonObjectConst configuration, JsonDocument& reply) {
+  JsonDocument json;
+  json["method"]        = "writeConfiguration";
+  json["configuration"] = configuration;
+  return request(json.as<JsonObjectConst>(), reply);
+}
+
+bool Client::sendFirmwarePacket(const std::vector<uint8_t>& image,
+                                uint32_t                    offset,
+                                const std::string&          hash,
+                                bool                        last) {
+  const uint32_t size = std::min<uint32_t>(blockSize, image.size() - offset);
+
+  JsonDocument json;
+  json["method"]          = "writeFirmware";
+  JsonObject jsonFirmware = json["firmware"].to<JsonObject>();
+  jsonFirmware["offset"]  = offset;
+  jsonFirmware["image"]   = hash;
+  if (last)
+    jsonFirmware["hash"] = hash;
+
+  // An 8-bit message carries the raw data after the JSON text.
+  const bool sysex8 = _transport->isSysEx8();
+  if (!sysex8)
+    jsonFirmware["data"] = encodeBase64(image.data() + offset, size);
+
+  // The device verifies the hash of the entire image after the last packet.
+  JsonDocument reply;
+  if (!request(json.as<JsonObjectConst>(),
+               sysex8 ? image.data() + offset : nullptr,
+               size,
+               reply,
+               last ? 10000 : 2000))
+    return false;
+
+  const char* status = reply["com.versioduo.device"]["firmware"]["status"];
+  if (!status) {
+    _error = "invalidReply";
+    return false;
+  }
+
+  if (strcmp(status, "success") != 0) {
+    _error = status;
+    return false;
+  }
+
+  return true;
+}
+
+bool Client::writeFirmware(const std::vector<uint8_t>& image, std::function<void(uint32_t offset)> progress) {
+  if (image.empty()) {
+    _error = "emptyImage";
+    return false;
+  }
+
+  const std::string hash = Client::hash(image.data(), image.size());
+
+  // Continue an interrupted upload; devices without support will not reply.
+  uint32_t offset = 0;
+  {
+    JsonDocument json;
+    json["method"]            = "getFirmwareProgress";
+    json["firmware"]["image"] = hash;
+
+    JsonDocument reply;
+    if (request(json.as<JsonObjectConst>(), reply, 500)) {
+      const uint32_t o = reply["com.versioduo.device"]["firmware"]["offset"] | 0;
+      if (o % blockSize == 0 && o < image.size())
+        offset = o;
+    }
+  }
+
+  for (; offset < image.size(); offset += blockSize) {
+    const bool last = offset + blockSize >= image.size();
+    if (!sendFirmwarePacket(image, offset, hash, last))
+      return false;
+
+    if (progress)
+      progress(offset);
+  }
+
+  // The device reboots with the new firmware.
+  _token = 0;
+  return true;
+}
+
+void Throttle::delay(size_t size) {
+  uint32_t usec = _latencyMs * 1000;
+  if (_bytesPerSecond > 0)
+    usec += (uint64_t)size * 1000 * 1000 / _bytesPerSecond;
+
+  std::this_thread::sleep_for(std::chrono::microseconds(usec));
+}
+
+bool Throttle::send(const std::vector<uint8_t>& message) {
+  delay(message.size());
+  return _transport->send(message);
+}
+
+bool Throttle::receive(std::vector<uint8_t>& message, uint32_t timeoutMs) {
+  if (!_transport->receive(message, timeoutMs))
+    return false;
+
+  delay(message.size());
+  return true;
+}
+
+RawMIDI::~RawMIDI() {
+  close();
+}
+
+bool RawMIDI::open() {
+  snd_rawmidi_t* input;
+  snd_rawmidi_t* output;
+  if (snd_rawmidi_open(&input, &output, _name.c_str(), SND_RAWMIDI_NONBLOCK) < 0)
+    return false;
+
+  // Writes block, reads are polled with a timeout.
+  snd_rawmidi_nonblock(output, 0);
+  _input  = input;
+  _output = output;
+  return true;
+}
+
+void RawMIDI::close() {
+  if (_input)
+    snd_rawmidi_close((snd_rawmidi_t*)_input);
+
+  if (_output)
+    snd_rawmidi_close((snd_rawmidi_t*)_output);
+
+  _input  = nullptr;
+  _output = nullptr;
+}
+
+bool RawMIDI::send(const std::vector<uint8_t>& message) {
+  if (!_output)
+    return false;
+
+  if (snd_rawmidi_write((snd_rawmidi_t*)_output, message.data(), message.size()) != (ssize_t)message.size())
+    return false;
+
+  return snd_rawmidi_drain((snd_rawmidi_t*)_output) == 0;
+}
+
+bool RawMIDI::receive(std::vector<uint8_t>& message, uint32_t timeoutMs) {
+  if (!_input)
+    return false;
+
+  const auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+  for (;;) {
+    // Parse the data of the previous read first; it might contain more than one message.
+    while (_position < _data.size()) {
+      if (_parser.parse(_data[_position++], message))
+        return true;
+    }
+
+    _data.resize(1024);
+    _position         = 0;
+    const ssize_t len = snd_rawmidi_read((snd_rawmidi_t*)_input, _data.data(), _data.size());
+    if (len < 0 && len != -EAGAIN) {
+      _data.clear();
+      return false;
+    }
+
+    _data.resize(len > 0 ? len : 0);
+    if (len > 0)
+      continue;
+
+    const auto now = std::chrono::steady_clock::now();
+    if (now >= end)
+      return false;
+
+    struct pollfd fds[4];
+    const int     count = snd_rawmidi_poll_descriptors((snd_rawmidi_t*)_input, fds, 4);
+    poll(fds, count, std::chrono::duration_cast<std::chrono::milliseconds>(end - now).count() + 1);
+  }
+}
+
+std::vector<std::string> RawMIDI::list() {
+  std::vector<std::string> names;
+
+  int card = -1;
+  while (snd_card_next(&card) == 0 && card >= 0) {
+    char name[32];
+    snprintf(name, sizeof(name), "hw:%d", card);
+
+    snd_ctl_t* ctl;
+    if (snd_ctl_open(&ctl, name, 0) < 0)
+      continue;
+
+    int device = -1;
+    while (snd_ctl_rawmidi_next_device(ctl, &device) == 0 && device >= 0) {
+      snd_rawmidi_info_t* info;
+      snd_rawmidi_info_alloca(&info);
+      snd_rawmidi_info_set_device(info, device);
+      snd_rawmidi_info_set_stream(info, SND_RAWMIDI_STREAM_OUTPUT);
+      if (snd_ctl_rawmidi_info(ctl, info) < 0)
+        continue;
+
+      const uint32_t subdevices = snd_rawmidi_info_get_subdevices_count(info);
+      for (uint32_t i = 0; i < subdevices; i++) {
+        snprintf(name, sizeof(name), "hw:%d,%d,%u", card, device, i);
+        names.push_back(name);
+      }
+    }
+
+    snd_ctl_close(ctl);
+  }
+
+  return names;
+}
+
+std::vector<Fleet::Result> Fleet::run(std::function<bool(Client& client)> function) {
+  std::vector<Result> results(_transports.size());
+  std::atomic<size_t> next{0};
+
+  auto worker = [&]() {
+    for (;;) {
+      const size_t i = next++;
+      if (i >= _transports.size())
+        return;
+
+      const auto start = std::chrono::steady_clock::now();
+      Client     client(_transports[i].get());
+      results[i].name    = _transports[i]->getName();
+      results[i].success = function(client);
+      if (!results[i].success)
+        results[i].error = client.getError();
+
+      results[i].msec =
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < std::min<size_t>(_threads, _transports.size()); i++)
+    threads.emplace_back(worker);
+
+  for (auto& thread : threads)
+    thread.join();
+
+  return results;
+}
+
+std::vector<Fleet::Result> Fleet::updateFirmware(const std::vector<uint8_t>&                                   image,
+                                                 const std::string&                                            id,
+                                                 std::function<void(const std::string& name, uint32_t offset)> progress) {
+  const std::string hash = Client::hash(image.data(), image.size());
+
+  return run([&](Client& client) {
+    JsonDocument json;
+    if (!client.getAll(json))
+      return false;
+
+    JsonObject jsonFirmware = json["com.versioduo.device"]["system"]["firmware"];
+    if (jsonFirmware["id"] != id) {
+      client.setError("differentFirmware");
+      return false;
+    }
+
+    // Already up-to-date.
+    if (jsonFirmware["hash"] == hash)
+      return true;
+
+    return client.writeFirmware(image, [&](uint32_t offset) {
+      if (progress)
+        progress(client.getTransport()->getName(), offset);
+    });
+  });
+}
+};
@@ -0,0 +1,191 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+// Host-side implementation of the "com.versioduo.device" protocol.
+#pragma once
+
+#include "V2DeviceProtocol.h"
+#include <ArduinoJson.h>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace V2DeviceHost {
+// A bidirectional SystemExclusive message stream to a single device.
+class Transport {
+public:
+  virtual ~Transport() = default;
+
+  // The name to show to the user.
+  virtual std::string getName() = 0;
+
+  // Send a complete SystemExclusive message, including the 0xf0/0xf7 framing.
+  virtual bool send(const std::vector<uint8_t>& message) = 0;
+
+  // Wait for the next complete SystemExclusive message. Other MIDI messages
+  // are ignored. Returns false after the timeout.
+  virtual bool receive(std::vector<uint8_t>& message, uint32_t timeoutMs) = 0;
+
+  // The messages are the payload of 8-bit SystemExclusive messages (UMP SysEx8),
+  // without the 0xf0/0xf7 framing. The JSON text is not escaped, firmware data
+  // follows the text after a NUL byte.
+  virtual bool isSysEx8() {
+    return false;
+  }
+};
+
+// ALSA rawmidi device, e.g. "hw:2,0,0".
+class RawMIDI : public Transport {
+public:
+  RawMIDI(const std::string& name) : _name(name) {}
+  ~RawMIDI();
+
+  bool open();
+  void close();
+
+  std::string getName() override {
+    return _name;
+  }
+
+  bool send(const std::vector<uint8_t>& message) override;
+  bool receive(std::vector<uint8_t>& message, uint32_t timeoutMs) override;
+
+  // The names of all rawmidi devices/subdevices of all sound cards.
+  static std::vector<std::string> list();
+
+private:
+  std::string          _name;
+  void*                _input{};
+  void*                _output{};
+  std::vector<uint8_t> _data;
+  size_t               _position{};
+  SysExParser          _parser;
+};
+
+// Delay and rate-limit another transport, to see the behavior over slow links.
+class Throttle : public Transport {
+public:
+  Throttle(Transport* transport, uint32_t bytesPerSecond, uint32_t latencyMs) :
+    _transport(transport),
+    _bytesPerSecond(bytesPerSecond),
+    _latencyMs(latencyMs) {}
+
+  std::string getName() override {
+    return _transport->getName();
+  }
+
+  bool isSysEx8() override {
+    return _transport->isSysEx8();
+  }
+
+  bool send(const std::vector<uint8_t>& message) override;
+  bool receive(std::vector<uint8_t>& message, uint32_t timeoutMs) override;
+
+private:
+  Transport* _transport;
+  uint32_t   _bytesPerSecond;
+  uint32_t   _latencyMs;
+
+  void delay(size_t size);
+};
+
+class Client {
+public:
+  // The size of the firmware packets; it needs to be a multiple of the device's
+  // flash block size.
+  static constexpr uint32_t blockSize = 8 * 1024;
+
+  Client(Transport* transport) : _transport(transport) {}
+
+  Transport* getTransport() {
+    return _transport;
+  }
+
+  // The token of the device, learned from the last reply. Requests carry the token,
+  // a rebooted device will not accept them.
+  uint32_t getToken() {
+    return _token;
+  }
+
+  void resetToken() {
+    _token = 0;
+  }
+
+  // Send a request and wait for the reply of the device. The request is the content
+  // of the "com.versioduo.device" object; the reply is the entire message.
+  bool request(JsonObjectConst request, JsonDocument& reply, uint32_t timeoutMs = 2000);
+
+  bool getAll(JsonDocument& reply);
+
+  // Write the configuration and return the updated device state.
+  bool writeConfiguration(JsonObjectConst configuration, JsonDocument& reply);
+
+  // Read the size report of the "getAll" reply; returns false if the reply is
+  // larger than the device's budget, or if it did not fit into the buffer.
+  bool checkReplyBudget(JsonDocument& report);
+
+  // Upload a firmware image. An upload of the same image which has been interrupted
+  // earlier is continued. The device reboots after the successful upload.
+  bool writeFirmware(const std::vector<uint8_t>& image, std::function<void(uint32_t offset)> progress = nullptr);
+
+  // The size of the last reply in bytes.
+  size_t getReplySize() {
+    return _replySize;
+  }
+
+  // The last error.
+  const std::string& getError() {
+    return _error;
+  }
+
+  void setError(const std::string& error) {
+    _error = error;
+  }
+
+  // SHA-1 hash of the data, hex encoded, as calculated by the device.
+  static std::string hash(const uint8_t* data, size_t size);
+
+private:
+  Transport*  _transport;
+  uint32_t    _token{};
+  size_t      _replySize{};
+  std::string _error;
+
+  // The data is appended to the message of a transport with 8-bit messages.
+  bool request(JsonObjectConst request, const uint8_t* data, size_t size, JsonDocument& reply, uint32_t timeoutMs);
+  bool sendFirmwarePacket(const std::vector<uint8_t>& image, uint32_t offset, const std::string& hash, bool last);
+};
+
+// Run the same operation on many devices in parallel.
+class Fleet {
+public:
+  struct Result {
+    std::string name;
+    bool        success;
+    std::string error;
+    uint32_t    msec;
+  };
+
+  Fleet(uint32_t threads) : _threads(threads) {}
+
+  void add(std::unique_ptr<Transport> transport) {
+    _transports.push_back(std::move(transport));
+  }
+
+  // Call the function with a client for every device, with up to 'threads'
+  // devices at the same time.
+  std::vector<Result> run(std::function<bool(Client& client)> function);
+
+  // Update all devices with the image. Devices with a different firmware id are skipped.
+  std::vector<Result> updateFirmware(const std::vector<uint8_t>& image,
+                                     const std::string&          id,
+                                     std::function<void(const std::string& name, uint32_t offset)> progress = nullptr);
+
+private:
+  uint32_t                                _threads;
+  std::vector<std::unique_ptr<Transport>> _transports;
+};
+};
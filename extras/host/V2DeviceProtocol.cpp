@@ -0,0 +1,252 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+#include "V2DeviceProtocol.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace V2DeviceHost {
+// Escape unicode to fit into a 7 bit byte stream.
+std::string escapeJSON(const std::string& json) {
+  std::string escaped;
+
+  for (size_t i = 0; i < json.size(); i++) {
+    const uint8_t c = json[i];
+    if (c < 0x80) {
+      escaped += (char)c;
+      continue;
+    }
+
+    uint32_t codepoint;
+    uint8_t  len;
+    if ((c & 0xe0) == 0xc0) {
+      codepoint = c & 0x1f;
+      len       = 2;
+
+    } else if ((c & 0xf0) == 0xe0) {
+      codepoint = c & 0x0f;
+      len       = 3;
+
+    } else if ((c & 0xf8) == 0xf0) {
+      codepoint = c & 0x07;
+      len       = 4;
+
+    } else
+      continue;
+
+    if (i + len > json.size())
+      break;
+
+    for (uint8_t k = 1; k < len; k++)
+      codepoint = (codepoint << 6) | (json[i + k] & 0x3f);
+    i += len - 1;
+
+    char buffer[16];
+    if (codepoint < 0xffff) {
+      snprintf(buffer, sizeof(buffer), "\\u%04x", codepoint);
+
+    } else {
+      codepoint -= 0x10000;
+      snprintf(buffer, sizeof(buffer), "\\u%04x\\u%04x", (codepoint >> 10) + 0xd800, (codepoint & 0x3ff) + 0xdc00);
+    }
+
+    escaped += buffer;
+  }
+
+  return escaped;
+}
+
+std::string encodeBase64(const uint8_t* data, size_t size) {
+  static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string       text;
+
+  for (size_t i = 0; i < size; i += 3) {
+    uint32_t triple = data[i] << 16;
+    if (i + 1 < size)
+      triple |= data[i + 1] << 8;
+    if (i + 2 < size)
+      triple |= data[i + 2];
+
+    text += table[(triple >> 18) & 0x3f];
+    text += table[(triple >> 12) & 0x3f];
+    text += i + 1 < size ? table[(triple >> 6) & 0x3f] : '=';
+    text += i + 2 < size ? table[triple & 0x3f] : '=';
+  }
+
+  return text;
+}
+
+std::string hashSHA1(const uint8_t* data, size_t size) {
+  uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+
+  // Padding; a single bit, zeros, and the length in bits.
+  std::vector<uint8_t> message(data, data + size);
+  message.push_back(0x80);
+  while (message.size() % 64 != 56)
+    message.push_back(0);
+
+  for (int8_t i = 7; i >= 0; i--)
+    message.push_back((uint64_t)size * 8 >> (i * 8));
+
+  auto rotate = [](uint32_t value, uint8_t bits) {
+    return (value << bits) | (value >> (32 - bits));
+  };
+
+  for (size_t chunk = 0; chunk < message.size(); chunk += 64) {
+    uint32_t w[80];
+    for (uint8_t i = 0; i < 16; i++)
+      w[i] = message[chunk + i * 4] << 24 | message[chunk + i * 4 + 1] << 16 | message[chunk + i * 4 + 2] << 8 |
+             message[chunk + i * 4 + 3];
+
+    for (uint8_t i = 16; i < 80; i++)
+      w[i] = rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = h[0];
+    uint32_t b = h[1];
+    uint32_t c = h[2];
+    uint32_t d = h[3];
+    uint32_t e = h[4];
+
+    for (uint8_t i = 0; i < 80; i++) {
+      uint32_t f;
+      uint32_t k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+
+      const uint32_t t = rotate(a, 5) + f + e + k + w[i];
+      e                = d;
+      d                = c;
+      c                = rotate(b, 30);
+      b                = a;
+      a                = t;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  char text[41];
+  for (uint8_t i = 0; i < 5; i++)
+    snprintf(text + i * 8, 9, "%08x", h[i]);
+
+  return text;
+}
+
+bool SysExParser::parse(uint8_t b, std::vector<uint8_t>& message) {
+  // Realtime messages may be interleaved with the SystemExclusive message.
+  if (b >= 0xf8)
+    return false;
+
+  if (b == 0xf0) {
+    _message.clear();
+    _sysex = true;
+
+  } else if (!_sysex)
+    return false;
+
+  // Any other status byte terminates the message.
+  else if ((b & 0x80) && b != 0xf7) {
+    _sysex = false;
+    return false;
+  }
+
+  _message.push_back(b);
+  if (b != 0xf7)
+    return false;
+
+  _sysex  = false;
+  message = std::move(_message);
+  _message.clear();
+  return true;
+}
+
+std::vector<uint32_t> packSysEx8(const uint8_t* data, size_t size, uint8_t group, uint8_t stream) {
+  std::vector<uint32_t> packets;
+
+  size_t offset = 0;
+  do {
+    const size_t len = std::min<size_t>(13, size - offset);
+
+    // Complete, start, continue, end.
+    uint8_t status;
+    if (offset == 0)
+      status = offset + len == size ? 0x0 : 0x1;
+    else
+      status = offset + len == size ? 0x3 : 0x2;
+
+    // The number of bytes includes the stream ID.
+    uint8_t bytes[14]{stream};
+    memcpy(bytes + 1, data + offset, len);
+
+    packets.push_back(0x5 << 28 | (group & 0xf) << 24 | status << 20 | (len + 1) << 16 | bytes[0] << 8 | bytes[1]);
+    for (uint8_t i = 2; i < 14; i += 4)
+      packets.push_back(bytes[i] << 24 | bytes[i + 1] << 16 | bytes[i + 2] << 8 | bytes[i + 3]);
+
+    offset += len;
+  } while (offset < size);
+
+  return packets;
+}
+
+bool SysEx8Parser::parse(uint32_t word, std::vector<uint8_t>& message) {
+  // The number of words of a packet, by message type.
+  static const uint8_t sizes[16]{1, 1, 1, 2, 2, 4, 1, 1, 2, 2, 2, 3, 3, 4, 4, 4};
+
+  _packet[_words++] = word;
+  if (_words < sizes[_packet[0] >> 28])
+    return false;
+
+  _words = 0;
+  if (_packet[0] >> 28 != 0x5)
+    return false;
+
+  const uint8_t status = (_packet[0] >> 20) & 0xf;
+  if (status == 0x0 || status == 0x1) {
+    _message.clear();
+    _sysex = true;
+
+  } else if (!_sysex)
+    return false;
+
+  uint8_t bytes[14];
+  bytes[0] = _packet[0] >> 8;
+  bytes[1] = _packet[0];
+  for (uint8_t i = 0; i < 3; i++) {
+    bytes[2 + i * 4] = _packet[1 + i] >> 24;
+    bytes[3 + i * 4] = _packet[1 + i] >> 16;
+    bytes[4 + i * 4] = _packet[1 + i] >> 8;
+    bytes[5 + i * 4] = _packet[1 + i];
+  }
+
+  // Skip the stream ID.
+  const uint8_t len = std::min<uint8_t>(14, (_packet[0] >> 16) & 0xf);
+  if (len > 1)
+    _message.insert(_message.end(), bytes + 1, bytes + len);
+
+  if (status != 0x0 && status != 0x3)
+    return false;
+
+  _sysex  = false;
+  message = std::move(_message);
+  _message.clear();
+  return true;
+}
+};
@@ -0,0 +1,51 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+// The encoding of the "com.versioduo.device" messages, without dependencies.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace V2DeviceHost {
+// Escape unicode to fit into a 7 bit byte stream.
+std::string escapeJSON(const std::string& json);
+
+std::string encodeBase64(const uint8_t* data, size_t size);
+
+// SHA-1 hash of the data, hex encoded, as calculated by the device.
+std::string hashSHA1(const uint8_t* data, size_t size);
+
+// Reassemble SystemExclusive messages from a MIDI byte stream.
+class SysExParser {
+public:
+  // Returns true when the byte completes a message, including the 0xf0/0xf7
+  // framing. Realtime messages are skipped, other messages are ignored.
+  bool parse(uint8_t b, std::vector<uint8_t>& message);
+
+private:
+  std::vector<uint8_t> _message;
+  bool                 _sysex{};
+};
+
+// Split the payload of an 8-bit SystemExclusive message into Universal MIDI
+// Packets (UMP) of message type 0x5, SysEx8. Every packet of four words carries
+// up to 13 bytes.
+std::vector<uint32_t> packSysEx8(const uint8_t* data, size_t size, uint8_t group = 0, uint8_t stream = 0);
+
+// Reassemble 8-bit SystemExclusive messages from a stream of UMP words.
+class SysEx8Parser {
+public:
+  // Returns true when the word completes a message; the payload without the
+  // stream ID. Packets of other message types are skipped.
+  bool parse(uint32_t word, std::vector<uint8_t>& message);
+
+private:
+  uint32_t             _packet[4]{};
+  uint8_t              _words{};
+  std::vector<uint8_t> _message;
+  bool                 _sysex{};
+};
+};
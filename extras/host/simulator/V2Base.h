@@ -0,0 +1,128 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+// The parts of the Arduino core and V2Base used by V2Device, implemented by
+// the simulator for a host build of the library.
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+
+// Arduino core.
+#define INPUT 0x0
+#define INPUT_PULLUP 0x2
+#define PIN_LED_ONBOARD 0
+#define USB_VID 0x6666
+#define USB_PID 0x6666
+
+template <typename A, typename B> static inline typename std::common_type<A, B>::type min(A a, B b) {
+  return a < b ? a : b;
+}
+
+template <typename A, typename B> static inline typename std::common_type<A, B>::type max(A a, B b) {
+  return a > b ? a : b;
+}
+
+static inline size_t v2base_strlcpy(char* dst, const char* src, size_t size) {
+  const size_t len = strlen(src);
+  if (size > 0) {
+    const size_t n = len < size - 1 ? len : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+  }
+
+  return len;
+}
+#define strlcpy v2base_strlcpy
+
+void     delay(uint32_t msec);
+uint32_t millis();
+void     yield();
+void     pinMode(uint8_t pin, uint8_t mode);
+int      digitalRead(uint8_t pin);
+
+namespace V2Base {
+template <typename T, size_t N> constexpr size_t countof(T (&)[N]) {
+  return N;
+}
+
+uint32_t getUsec();
+
+namespace Power {
+  enum class Mode { Idle };
+  void sleep();
+  void setSleepMode(Mode mode);
+};
+
+namespace Cryptography::Random {
+  uint32_t read();
+};
+
+namespace Text::Base64 {
+  uint32_t decode(const uint8_t* text, uint8_t* data);
+};
+
+namespace Timer {
+  class Periodic {
+  public:
+    constexpr Periodic(uint8_t priority, uint32_t usec) {}
+    void begin(std::function<void()> function) {}
+    void setPriority(uint8_t priority) {}
+  };
+};
+
+// The memory of the simulated device which is currently running. Flash
+// addresses are 32 bit values; the simulator maps the flash into the lower
+// 4 GB of the address space.
+namespace Memory {
+  namespace RAM {
+    uint32_t getSize();
+    uint32_t getFree();
+  };
+
+  namespace EEPROM {
+    uint8_t* getStart();
+    uint32_t getSize();
+    void     erase();
+    void     write(uint32_t offset, const uint8_t* data, uint32_t size);
+  };
+
+  namespace Flash {
+    constexpr uint32_t getBlockSize() {
+      return 8 * 1024;
+    }
+
+    uint32_t getSize();
+    void     eraseBlock(uint32_t address);
+    void     writeBlock(uint32_t address, const uint32_t* data);
+
+    namespace UserPage {
+      bool update();
+    };
+  };
+
+  namespace Firmware {
+    uint32_t getStart();
+    uint32_t getSize();
+    void     calculateHash(uint32_t start, uint32_t size, char* hash);
+
+    // Throws; the simulator creates the device again.
+    void reboot();
+
+    namespace Secondary {
+      uint32_t getStart();
+      void     writeBlock(uint32_t offset, const uint32_t* data);
+      void     copyBootloader();
+      bool     verify(uint32_t size, const char* hash);
+
+      // Copies the secondary image and reboots.
+      void activate();
+    };
+  };
+};
+};
@@ -0,0 +1,568 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+// The library is built from its sources, with the headers of this directory
+// in place of the Arduino libraries. All devices run in a single thread; the
+// static state of V2Device.cpp, the boot data and the JSON allocator, is
+// switched with the device.
+#include "../../../src/V2Device.cpp"
+#include "V2DeviceSimulator.h"
+#include "../V2DeviceProtocol.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <sys/mman.h>
+
+V2DEVICE_METADATA("com.versioduo.simulator", 1, "versioduo:samd:simulator");
+
+using TimePoint = std::chrono::steady_clock::time_point;
+
+// The flash of a SAMD51 with 512 kB; the bootloader, the firmware and the
+// secondary area for the firmware update.
+static constexpr uint32_t flashSize       = 512 * 1024;
+static constexpr uint32_t bootloaderSize  = 16 * 1024;
+static constexpr uint32_t imageSize       = 240 * 1024;
+static constexpr uint32_t secondaryOffset = bootloaderSize + imageSize;
+static constexpr uint32_t ramSize         = 192 * 1024;
+
+// A reboot unwinds the stack to the simulator loop.
+struct Reboot {};
+
+namespace V2DeviceHost {
+// A one-way connection. A message arrives after the transfer of the previous
+// messages, its own transfer time and the latency. USB MIDI 1.0 transfers
+// SystemExclusive messages in packets of four bytes, which carry three bytes of
+// the message.
+class Simulator::Channel : public V2MIDI::Transport::Channel {
+public:
+  Channel(Rate rate, bool usbMIDI) : _rate(rate), _usbMIDI(usbMIDI) {}
+
+  bool send(const uint8_t* buffer, uint32_t len) override {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto                  start = std::max(std::chrono::steady_clock::now(), _busy);
+    _busy                             = start;
+    if (_rate.bytesPerSecond > 0) {
+      const uint64_t size = _usbMIDI ? (len + 2) / 3 * 4 : len;
+      _busy += std::chrono::microseconds(size * 1000 * 1000 / _rate.bytesPerSecond);
+    }
+
+    _queue.push_back({_busy + std::chrono::milliseconds(_rate.latencyMs), std::vector<uint8_t>(buffer, buffer + len)});
+    _condition.notify_all();
+    return true;
+  }
+
+  bool idle() override {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return std::chrono::steady_clock::now() >= _busy;
+  }
+
+  // The next message which has arrived, without waiting.
+  bool receive(std::vector<uint8_t>& message) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_queue.empty() || _queue.front().time > std::chrono::steady_clock::now())
+      return false;
+
+    message = std::move(_queue.front().data);
+    _queue.pop_front();
+    return true;
+  }
+
+  // Wait for the next message until 'end'.
+  bool receive(std::vector<uint8_t>& message, TimePoint end) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+      const auto now = std::chrono::steady_clock::now();
+      if (!_queue.empty() && _queue.front().time <= now) {
+        message = std::move(_queue.front().data);
+        _queue.pop_front();
+        return true;
+      }
+
+      if (now >= end)
+        return false;
+
+      _condition.wait_until(lock, _queue.empty() ? end : std::min(end, _queue.front().time));
+    }
+  }
+
+private:
+  struct Message {
+    TimePoint            time;
+    std::vector<uint8_t> data;
+  };
+
+  Rate                    _rate;
+  bool                    _usbMIDI;
+  std::mutex              _mutex;
+  std::condition_variable _condition;
+  std::deque<Message>     _queue;
+
+  // The end of the transfer of the last message.
+  TimePoint _busy{};
+};
+};
+
+// A device with a small configuration; the children are connected to the socket
+// of the link.
+class SimulatedDevice final : public V2Device {
+public:
+  SimulatedDevice(V2DeviceHost::Simulator::Device* device) : _device(device) {
+    metadata.vendor      = "Versio Duo";
+    metadata.product     = "V2 Simulator";
+    metadata.description = "Simulated Device";
+    metadata.home        = "https://versioduo.com";
+
+    configuration.version = 1;
+    configuration.size    = sizeof(_config);
+    configuration.data    = &_config;
+    configuration.presets = 4;
+  }
+
+private:
+  V2DeviceHost::Simulator::Device* _device;
+
+  struct {
+    uint8_t channel;
+    uint8_t velocity;
+    char    text[64];
+  } _config{0, 100, ""};
+
+  void importConfiguration(JsonObject json) override {
+    if (!json["channel"].isNull()) {
+      const uint8_t channel = json["channel"];
+      if (channel >= 1 && channel <= 16)
+        _config.channel = channel - 1;
+    }
+
+    if (!json["velocity"].isNull()) {
+      const uint8_t velocity = json["velocity"];
+      if (velocity <= 127)
+        _config.velocity = velocity;
+    }
+
+    if (json["text"])
+      strlcpy(_config.text, json["text"], sizeof(_config.text));
+  }
+
+  void exportConfiguration(JsonObject json) override {
+    json["#channel"] = "The MIDI channel";
+    json["channel"]  = _config.channel + 1;
+    json["velocity"] = _config.velocity;
+    json["text"]     = _config.text;
+  }
+
+  bool sendToChild(uint8_t position, const uint8_t* buffer, uint32_t len) override;
+  bool sendSystemExclusive8(V2MIDI::Transport* transport, const uint8_t* buffer, uint32_t len) override;
+};
+
+// The words of Universal MIDI Packets are transferred in the byte order of the host.
+static std::vector<uint8_t> packUMP(const uint8_t* data, size_t size) {
+  const std::vector<uint32_t> packets = V2DeviceHost::packSysEx8(data, size);
+  std::vector<uint8_t>        bytes(packets.size() * sizeof(uint32_t));
+  memcpy(bytes.data(), packets.data(), bytes.size());
+  return bytes;
+}
+
+// Returns true if the bytes complete a message.
+static bool unpackUMP(V2DeviceHost::SysEx8Parser& parser, const std::vector<uint8_t>& bytes, std::vector<uint8_t>& message) {
+  bool complete = false;
+  for (size_t i = 0; i + sizeof(uint32_t) <= bytes.size(); i += sizeof(uint32_t)) {
+    uint32_t word;
+    memcpy(&word, bytes.data() + i, sizeof(word));
+    complete |= parser.parse(word, message);
+  }
+
+  return complete;
+}
+
+// The state of a device which survives a reboot; the flash, the EEPROM and
+// the boot data.
+class V2DeviceHost::Simulator::Device {
+public:
+  std::string name;
+  Device*     parent;
+  uint8_t     position;
+
+  // The messages to and from the host, or the parent.
+  Channel input;
+  Channel output;
+
+  std::vector<std::unique_ptr<Device>> children;
+
+  // The USB connection is a USB MIDI 2.0 endpoint.
+  bool ump;
+
+  uint8_t* flash;
+  uint32_t firmwareSize{64 * 1024};
+  uint32_t verifiedSize{};
+  uint8_t  eeprom[4 * 1024];
+
+  Device(const std::string& n, Rate rate, Device* p, uint8_t pos, bool u = false) :
+    name(n),
+    parent(p),
+    position(pos),
+    input(rate, !p && !u),
+    output(rate, !p && !u),
+    ump(u) {
+    // The addresses of the flash are 32 bit values.
+    flash = (uint8_t*)mmap(nullptr, flashSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    if (flash == MAP_FAILED) {
+      perror("mmap");
+      abort();
+    }
+
+    memset(flash, 0xff, flashSize);
+    memset(eeprom, 0xff, sizeof(eeprom));
+    memcpy(_bootData, &bootData, sizeof(_bootData));
+
+    // The end of the bootloader contains the location of its metadata.
+    const char board[] = "{\"com.versioduo.bootloader\":{\"board\":\"versioduo:samd:simulator\"}}";
+    memcpy(flash, board, sizeof(board));
+    uint32_t* info = (uint32_t*)(flash + bootloaderSize) - 4;
+    info[0]        = (uint32_t)(uintptr_t)flash;
+
+    // The same firmware image on all devices.
+    std::mt19937 random(1);
+    for (uint32_t i = 0; i < firmwareSize; i++)
+      flash[bootloaderSize + i] = random();
+  }
+
+  ~Device() {
+    munmap(flash, flashSize);
+  }
+
+  // The device which is running; the memory functions of V2Base access it.
+  static Device* current;
+
+  // Handle the received messages and run the loop of the device and its children.
+  void loop();
+
+private:
+  uint8_t  _bootData[sizeof(bootData)];
+  uint32_t _jsonUsed{};
+
+  V2Link       _link;
+  V2Link::Port _plug;
+  V2Link::Port _socket;
+
+  V2DeviceHost::SysEx8Parser _parser;
+
+  std::unique_ptr<SimulatedDevice> _device;
+
+  void select() {
+    current = this;
+    memcpy(&bootData, _bootData, sizeof(_bootData));
+#if V2DEVICE_STATISTICS
+    jsonAllocator.used = _jsonUsed;
+#endif
+  }
+
+  void deselect() {
+    memcpy(_bootData, &bootData, sizeof(_bootData));
+#if V2DEVICE_STATISTICS
+    _jsonUsed = jsonAllocator.used;
+#endif
+    current = nullptr;
+  }
+
+  void start();
+};
+
+V2DeviceHost::Simulator::Device* V2DeviceHost::Simulator::Device::current{};
+
+static V2DeviceHost::Simulator::Device* current() {
+  return V2DeviceHost::Simulator::Device::current;
+}
+
+bool SimulatedDevice::sendToChild(uint8_t position, const uint8_t* buffer, uint32_t len) {
+  if (position == 0 || position > _device->children.size())
+    return false;
+
+  return _device->children[position - 1]->input.send(buffer, len);
+}
+
+bool SimulatedDevice::sendSystemExclusive8(V2MIDI::Transport* transport, const uint8_t* buffer, uint32_t len) {
+  const std::vector<uint8_t> bytes = packUMP(buffer, len);
+  return _device->output.send(bytes.data(), bytes.size());
+}
+
+// Power-on; the RAM is cleared.
+void V2DeviceHost::Simulator::Device::start() {
+  _device  = std::make_unique<SimulatedDevice>(this);
+  _jsonUsed = 0;
+  _link     = {};
+  _plug     = {};
+  _socket   = {};
+
+  if (parent) {
+    _plug.channel = &output;
+    _link.plug    = &_plug;
+    _device->link = &_link;
+
+  } else
+    _device->usb.midi.channel = &output;
+
+  if (!children.empty()) {
+    _link.socket  = &_socket;
+    _device->link = &_link;
+  }
+
+  _device->begin();
+}
+
+void V2DeviceHost::Simulator::Device::loop() {
+  select();
+
+  try {
+    if (!_device)
+      start();
+
+    V2MIDI::Transport* transport = parent ? (V2MIDI::Transport*)&_plug : &_device->usb.midi;
+
+    std::vector<uint8_t> message;
+    while (input.receive(message)) {
+      if (ump) {
+        std::vector<uint8_t> payload;
+        if (unpackUMP(_parser, message, payload))
+          _device->dispatchSystemExclusive8(transport, payload.data(), payload.size());
+
+      } else
+        _device->dispatchSystemExclusive(transport, message.data(), message.size());
+    }
+
+    for (auto& child : children) {
+      while (child->output.receive(message))
+        _device->dispatchChild(child->position, message.data(), message.size());
+    }
+
+    _device->loop();
+
+  } catch (const Reboot&) {
+    _device.reset();
+  }
+
+  deselect();
+
+  for (auto& child : children)
+    child->loop();
+}
+
+// The Arduino core.
+void delay(uint32_t msec) {
+  // All devices share the thread, a delay would stall the other devices.
+}
+
+uint32_t millis() {
+  return V2Base::getUsec() / 1000;
+}
+
+void yield() {}
+void pinMode(uint8_t pin, uint8_t mode) {}
+
+int digitalRead(uint8_t pin) {
+  return 1;
+}
+
+uint32_t V2Base::getUsec() {
+  static const auto start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() + 1;
+}
+
+void V2Base::Power::sleep() {}
+void V2Base::Power::setSleepMode(Mode mode) {}
+
+uint32_t V2Base::Cryptography::Random::read() {
+  static std::mt19937 random(std::random_device{}());
+  return random();
+}
+
+uint32_t V2Base::Text::Base64::decode(const uint8_t* text, uint8_t* data) {
+  uint32_t len   = 0;
+  uint32_t bits  = 0;
+  uint8_t  count = 0;
+  for (; *text != '\0' && *text != '='; text++) {
+    const uint8_t value = V2DeviceBase64::table[*text];
+    if (value & 0x80)
+      return 0;
+
+    bits = bits << 6 | value;
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      data[len++] = bits >> count;
+    }
+  }
+
+  return len;
+}
+
+// The device object holds most of the static data of a real device.
+uint32_t V2Base::Memory::RAM::getSize() {
+  return ramSize;
+}
+
+uint32_t V2Base::Memory::RAM::getFree() {
+#if V2DEVICE_STATISTICS
+  return ramSize - sizeof(SimulatedDevice) - jsonAllocator.used;
+#else
+  return ramSize - sizeof(SimulatedDevice);
+#endif
+}
+
+uint8_t* V2Base::Memory::EEPROM::getStart() {
+  return current()->eeprom;
+}
+
+uint32_t V2Base::Memory::EEPROM::getSize() {
+  return sizeof(current()->eeprom);
+}
+
+void V2Base::Memory::EEPROM::erase() {
+  memset(current()->eeprom, 0xff, sizeof(current()->eeprom));
+}
+
+void V2Base::Memory::EEPROM::write(uint32_t offset, const uint8_t* data, uint32_t size) {
+  if (offset + size <= sizeof(current()->eeprom))
+    memcpy(current()->eeprom + offset, data, size);
+}
+
+uint32_t V2Base::Memory::Flash::getSize() {
+  return flashSize;
+}
+
+void V2Base::Memory::Flash::eraseBlock(uint32_t address) {
+  memset((void*)(uintptr_t)address, 0xff, getBlockSize());
+}
+
+void V2Base::Memory::Flash::writeBlock(uint32_t address, const uint32_t* data) {
+  memcpy((void*)(uintptr_t)address, data, getBlockSize());
+}
+
+bool V2Base::Memory::Flash::UserPage::update() {
+  return false;
+}
+
+uint32_t V2Base::Memory::Firmware::getStart() {
+  return (uint32_t)(uintptr_t)(current()->flash + bootloaderSize);
+}
+
+uint32_t V2Base::Memory::Firmware::getSize() {
+  return current()->firmwareSize;
+}
+
+void V2Base::Memory::Firmware::calculateHash(uint32_t start, uint32_t size, char* hash) {
+  strcpy(hash, V2DeviceHost::hashSHA1((const uint8_t*)(uintptr_t)start, size).c_str());
+}
+
+void V2Base::Memory::Firmware::reboot() {
+  throw Reboot();
+}
+
+uint32_t V2Base::Memory::Firmware::Secondary::getStart() {
+  return (uint32_t)(uintptr_t)(current()->flash + secondaryOffset);
+}
+
+void V2Base::Memory::Firmware::Secondary::writeBlock(uint32_t offset, const uint32_t* data) {
+  if (offset + Flash::getBlockSize() <= imageSize)
+    memcpy(current()->flash + secondaryOffset + offset, data, Flash::getBlockSize());
+}
+
+void V2Base::Memory::Firmware::Secondary::copyBootloader() {}
+
+bool V2Base::Memory::Firmware::Secondary::verify(uint32_t size, const char* hash) {
+  if (size > imageSize)
+    return false;
+
+  if (V2DeviceHost::hashSHA1(current()->flash + secondaryOffset, size) != hash)
+    return false;
+
+  current()->verifiedSize = size;
+  return true;
+}
+
+void V2Base::Memory::Firmware::Secondary::activate() {
+  memcpy(current()->flash + bootloaderSize, current()->flash + secondaryOffset, current()->verifiedSize);
+  current()->firmwareSize = current()->verifiedSize;
+  throw Reboot();
+}
+
+namespace V2DeviceHost {
+// The host side of the USB connection.
+class SimulatorTransport : public Transport {
+public:
+  SimulatorTransport(Simulator::Device* device) : _device(device) {}
+
+  std::string getName() override {
+    return _device->name;
+  }
+
+  bool isSysEx8() override {
+    return _device->ump;
+  }
+
+  bool send(const std::vector<uint8_t>& message) override {
+    if (!_device->ump)
+      return _device->input.send(message.data(), message.size());
+
+    const std::vector<uint8_t> bytes = packUMP(message.data(), message.size());
+    return _device->input.send(bytes.data(), bytes.size());
+  }
+
+  bool receive(std::vector<uint8_t>& message, uint32_t timeoutMs) override {
+    const auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    if (!_device->ump)
+      return _device->output.receive(message, end);
+
+    std::vector<uint8_t> bytes;
+    while (_device->output.receive(bytes, end)) {
+      if (unpackUMP(_parser, bytes, message))
+        return true;
+    }
+
+    return false;
+  }
+
+private:
+  Simulator::Device* _device;
+  SysEx8Parser       _parser;
+};
+
+Simulator::Simulator(const Options& options) {
+  for (uint32_t i = 0; i < options.devices; i++) {
+    const std::string name   = "sim:" + std::to_string(i);
+    auto              device = std::make_unique<Device>(name, options.usb, nullptr, 0, options.ump);
+
+    // Port 0 is the device itself.
+    for (uint8_t c = 1; c <= options.children && c < 16; c++)
+      device->children.push_back(
+        std::make_unique<Device>(name + "/" + std::to_string(c), options.link, device.get(), c));
+
+    _devices.push_back(std::move(device));
+  }
+
+  _thread = std::thread(&Simulator::run, this);
+}
+
+Simulator::~Simulator() {
+  _stop = true;
+  _thread.join();
+}
+
+std::unique_ptr<Transport> Simulator::connect(uint32_t index) {
+  if (index >= _devices.size())
+    return nullptr;
+
+  return std::make_unique<SimulatorTransport>(_devices[index].get());
+}
+
+void Simulator::run() {
+  while (!_stop) {
+    for (auto& device : _devices)
+      device->loop();
+
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+}
+};
@@ -0,0 +1,55 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+// Virtual devices running the V2Device library, connected to the host with
+// transports of a given bandwidth and latency. The children of a device are
+// connected with a simulated V2Link.
+#pragma once
+
+#include "../V2DeviceClient.h"
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace V2DeviceHost {
+class Simulator {
+public:
+  // A bandwidth of 0 transfers a message without delay.
+  struct Rate {
+    uint32_t bytesPerSecond;
+    uint32_t latencyMs;
+  };
+
+  struct Options {
+    uint32_t devices{1};
+
+    // The number of children connected to every device.
+    uint8_t children{};
+
+    Rate usb{};
+    Rate link{100 * 1000, 1};
+
+    // Connect the devices with a USB MIDI 2.0 endpoint; the requests and replies
+    // are 8-bit SystemExclusive messages in Universal MIDI Packets (UMP).
+    bool ump{};
+  };
+
+  Simulator(const Options& options);
+  ~Simulator();
+
+  // The host side of the USB connection of the device, named "sim:<index>".
+  // The simulator needs to outlive the transport.
+  std::unique_ptr<Transport> connect(uint32_t index);
+
+  class Device;
+  class Channel;
+
+private:
+  std::vector<std::unique_ptr<Device>> _devices;
+  std::atomic<bool>                    _stop{};
+  std::thread                          _thread;
+
+  void run();
+};
+};
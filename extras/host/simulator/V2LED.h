@@ -0,0 +1,19 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+// The parts of V2LED used by V2Device, for a host build of the library.
+#pragma once
+
+#include <V2Base.h>
+
+namespace V2LED {
+class Basic {
+public:
+  constexpr Basic(uint8_t pin, V2Base::Timer::Periodic* timer) {}
+
+  void tick() {}
+  void reset() {}
+  void loop() {}
+  void setBrightness(float fraction) {}
+};
+};
@@ -0,0 +1,22 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+// The parts of V2Link used by V2Device, for a host build of the library.
+#pragma once
+
+#include <V2MIDI.h>
+
+class V2Link {
+public:
+  // The plug connects to the parent, the socket to the children.
+  class Port : public V2MIDI::Transport {
+  public:
+    struct {
+      uint32_t input;
+      uint32_t output;
+    } statistics{};
+  };
+
+  Port* plug{};
+  Port* socket{};
+};
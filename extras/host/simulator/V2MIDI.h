@@ -0,0 +1,168 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+// The parts of V2MIDI used by V2Device, implemented by the simulator for a
+// host build of the library. Like on the hardware, a SystemExclusive message
+// is queued in the buffer of the port and sent from loopSystemExclusive(); it
+// is handed to the channel as a whole, the simulator models the transfer time.
+#pragma once
+
+#include <V2Base.h>
+
+namespace V2MIDI {
+class Packet {
+public:
+  enum class Status : uint8_t {
+    ProgramChange      = 0xc0,
+    SystemExclusive    = 0xf0,
+    SystemExclusiveEnd = 0xf7,
+  };
+};
+
+class Transport {
+public:
+  // The connection to the other side; it is provided by the simulator.
+  class Channel {
+  public:
+    virtual bool send(const uint8_t* buffer, uint32_t len) = 0;
+
+    // The previous messages have been transferred.
+    virtual bool idle() = 0;
+  };
+
+  Channel* channel{};
+
+  bool idle() {
+    return !channel || channel->idle();
+  }
+};
+
+class USBDevice : public Transport {
+public:
+  void begin() {}
+  void setVendor(const char* vendor) {}
+  void setName(const char* name) {}
+  void setConfigureURL(const char* url, const char* name) {}
+  void setPorts(uint8_t ports) {}
+  void setVIDPID(uint16_t vid, uint16_t pid) {}
+  void setVersion(uint32_t version) {}
+  void attach() {}
+  void detach() {}
+
+  bool connected() {
+    return true;
+  }
+
+  uint32_t getConnectionSequence() {
+    return 1;
+  }
+
+  void readSerial(char* serial) {
+    strcpy(serial, "SIMULATOR");
+  }
+};
+
+class SerialDevice : public Transport {
+public:
+  struct {
+    uint32_t input;
+    uint32_t output;
+  } statistics{};
+};
+
+class Port {
+public:
+  enum class Clock { Start, Continue, Stop, Tick };
+
+  struct Counter {
+    uint32_t packet;
+    uint32_t note;
+    uint32_t noteOff;
+    uint32_t aftertouch;
+    uint32_t control;
+    uint32_t program;
+    uint32_t aftertouchChannel;
+    uint32_t pitchbend;
+    struct {
+      uint32_t exclusive;
+      uint32_t reset;
+      struct {
+        uint32_t tick;
+      } clock;
+    } system;
+  };
+
+  constexpr Port(uint8_t index, uint32_t sysexSize) : _sysexSize(sysexSize) {}
+
+  ~Port() {
+    delete[] _sysexBuffer;
+  }
+
+  void begin() {
+    if (!_sysexBuffer)
+      _sysexBuffer = new uint8_t[_sysexSize];
+  }
+
+  // A complete SystemExclusive message, including the 0xf0/0xf7 framing,
+  // received from the transport.
+  void dispatchSystemExclusive(Transport* transport, const uint8_t* buffer, uint32_t len) {
+    _statistics.input.packet++;
+    _statistics.input.system.exclusive++;
+    handleSystemExclusive(transport, buffer, len);
+  }
+
+protected:
+  const uint32_t _sysexSize;
+
+  struct {
+    Counter input;
+    Counter output;
+  } _statistics{};
+
+  uint8_t* getSystemExclusiveBuffer() {
+    return _sysexBuffer;
+  }
+
+  // A queued message which has not been sent is replaced.
+  bool sendSystemExclusive(Transport* transport, uint32_t len) {
+    if (!transport->channel)
+      return false;
+
+    _statistics.output.packet++;
+    _statistics.output.system.exclusive++;
+    _sysex.transport = transport;
+    _sysex.len       = len;
+    return true;
+  }
+
+  // Send the queued message when the channel has transferred the previous
+  // messages; returns the number of bytes which are still queued.
+  uint32_t loopSystemExclusive() {
+    if (_sysex.len == 0)
+      return 0;
+
+    if (!_sysex.transport->channel->idle())
+      return _sysex.len;
+
+    _sysex.transport->channel->send(_sysexBuffer, _sysex.len);
+    _sysex.len = 0;
+    return 0;
+  }
+
+  void resetSystemExclusive() {
+    _sysex.len = 0;
+  }
+
+  virtual void handleSystemExclusive(Transport* transport, const uint8_t* buffer, uint32_t len) {}
+  virtual void handleSwitchChannel(uint8_t channel) {}
+  virtual void handleClock(Clock clock) {}
+
+private:
+  uint8_t* _sysexBuffer{};
+
+  struct {
+    Transport* transport;
+    uint32_t   len;
+  } _sysex{};
+};
+};
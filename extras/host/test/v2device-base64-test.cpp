@@ -0,0 +1,165 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+// Test the firmware block decoder against a reference encoder, and compare its
+// speed with the previous character-by-character decoder.
+//
+// Usage: v2device-base64-test [--benchmark]
+#include "../../../src/V2DeviceBase64.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static constexpr uint32_t blockSize = 8 * 1024;
+
+static std::string encode(const uint8_t* data, size_t size) {
+  static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string       text;
+
+  for (size_t i = 0; i < size; i += 3) {
+    uint32_t triple = data[i] << 16;
+    if (i + 1 < size)
+      triple |= data[i + 1] << 8;
+    if (i + 2 < size)
+      triple |= data[i + 2];
+
+    text += table[(triple >> 18) & 0x3f];
+    text += table[(triple >> 12) & 0x3f];
+    text += i + 1 < size ? table[(triple >> 6) & 0x3f] : '=';
+    text += i + 2 < size ? table[triple & 0x3f] : '=';
+  }
+
+  return text;
+}
+
+// The previous decoder; one character at a time into a temporary buffer, which
+// is copied into the block.
+static int8_t value(uint8_t c) {
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A';
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 26;
+  if (c >= '0' && c <= '9')
+    return c - '0' + 52;
+  if (c == '+')
+    return 62;
+  if (c == '/')
+    return 63;
+  return -1;
+}
+
+static bool decodeBytes(const char* data, uint32_t dataLen, uint32_t* block, uint32_t* len) {
+  uint8_t  buffer[blockSize + 3];
+  uint32_t size = 0;
+  uint32_t bits = 0;
+  uint8_t  count = 0;
+
+  for (uint32_t i = 0; i < dataLen; i++) {
+    if (data[i] == '=')
+      break;
+
+    const int8_t v = value(data[i]);
+    if (v < 0 || size >= sizeof(buffer))
+      return false;
+
+    bits = bits << 6 | v;
+    if (++count == 4) {
+      buffer[size++] = bits >> 16;
+      buffer[size++] = bits >> 8;
+      buffer[size++] = bits;
+      bits           = 0;
+      count          = 0;
+    }
+  }
+
+  if (count == 2)
+    buffer[size++] = bits >> 4;
+  else if (count == 3) {
+    buffer[size++] = bits >> 10;
+    buffer[size++] = bits >> 2;
+  }
+
+  if (size > blockSize)
+    return false;
+
+  memcpy(block, buffer, size);
+  *len = size;
+  return true;
+}
+
+static uint32_t failed = 0;
+
+static void check(bool condition, const char* test, size_t size) {
+  if (condition)
+    return;
+
+  printf("FAIL: %s, size %zu\n", test, size);
+  failed++;
+}
+
+int main(int argc, char** argv) {
+  std::vector<uint8_t> data(blockSize + 16);
+  srand(1);
+  for (auto& b : data)
+    b = rand();
+
+  static uint32_t block[blockSize / 4 + 4];
+  uint32_t        len;
+
+  // Every size up to a full block, and one byte more.
+  for (size_t size = 0; size <= blockSize + 1; size++) {
+    const std::string text   = encode(data.data(), size);
+    const bool        result = V2DeviceBase64::decode(text.data(), text.size(), block, blockSize, &len);
+    if (size > blockSize) {
+      check(!result, "oversized block accepted", size);
+      continue;
+    }
+
+    check(result, "valid data rejected", size);
+    check(result && len == size && memcmp(block, data.data(), size) == 0, "data mismatch", size);
+  }
+
+  // Invalid input.
+  {
+    std::string text = encode(data.data(), 1000);
+    for (size_t i = 0; i < text.size(); i += 97) {
+      std::string invalid = text;
+      invalid[i]          = '!';
+      check(!V2DeviceBase64::decode(invalid.data(), invalid.size(), block, blockSize, &len), "invalid character", i);
+    }
+
+    check(!V2DeviceBase64::decode(text.data(), text.size() - 1, block, blockSize, &len), "truncated data", 999);
+
+    std::string padded = encode(data.data(), 1) + text;
+    check(!V2DeviceBase64::decode(padded.data(), padded.size(), block, blockSize, &len), "padding in the middle", 0);
+  }
+
+  if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+    const std::string text = encode(data.data(), blockSize);
+    const uint32_t    runs = 20000;
+
+    auto measure = [&](const char* name, bool (*decode)(const char*, uint32_t, uint32_t*, uint32_t*)) {
+      const auto start = std::chrono::steady_clock::now();
+      for (uint32_t i = 0; i < runs; i++)
+        decode(text.data(), text.size(), block, &len);
+
+      const auto nsec =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+      printf("%s: %.1f usec per block, %.0f MB/s\n", name, nsec / 1000.0 / runs, (double)blockSize * runs * 1000 / nsec);
+    };
+
+    measure("bytes", decodeBytes);
+    measure("words", [](const char* data, uint32_t dataLen, uint32_t* block, uint32_t* len) {
+      return V2DeviceBase64::decode(data, dataLen, block, blockSize, len);
+    });
+  }
+
+  if (failed > 0)
+    return 1;
+
+  printf("All tests passed.\n");
+  return 0;
+}
@@ -0,0 +1,167 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+// Test the message encoding of the host library: the SHA-1 hash of the firmware
+// image, base64, the unicode escaping, the SystemExclusive reassembly and the 8-bit
+// SystemExclusive Universal MIDI Packets.
+//
+// Usage: v2device-protocol-test
+#include "../../../src/V2DeviceBase64.h"
+#include "../V2DeviceProtocol.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static uint32_t failed = 0;
+
+static void check(bool condition, const char* test) {
+  if (condition)
+    return;
+
+  printf("FAIL: %s\n", test);
+  failed++;
+}
+
+static std::string hash(const std::string& text) {
+  return V2DeviceHost::hashSHA1((const uint8_t*)text.data(), text.size());
+}
+
+static std::string encode(const std::string& text) {
+  return V2DeviceHost::encodeBase64((const uint8_t*)text.data(), text.size());
+}
+
+// Feed the stream in chunks of the given size, collect the messages.
+static std::vector<std::vector<uint8_t>> parse(const std::vector<uint8_t>& stream, size_t chunk) {
+  V2DeviceHost::SysExParser         parser;
+  std::vector<std::vector<uint8_t>> messages;
+
+  for (size_t i = 0; i < stream.size(); i += chunk) {
+    for (size_t k = i; k < std::min(i + chunk, stream.size()); k++) {
+      std::vector<uint8_t> message;
+      if (parser.parse(stream[k], message))
+        messages.push_back(message);
+    }
+  }
+
+  return messages;
+}
+
+int main() {
+  // FIPS 180 test vectors.
+  check(hash("") == "da39a3ee5e6b4b0d3255bfef95601890afd80709", "sha1 empty");
+  check(hash("abc") == "a9993e364706816aba3e25717850c26c9cd0d89d", "sha1 abc");
+  check(hash("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq") ==
+          "84983e441c3bd26ebaae4aa1f95129e5e54670f1",
+        "sha1 two blocks");
+  check(hash(std::string(1000000, 'a')) == "34aa973cd4c4daa4f61eeb2bdbad27316534016f", "sha1 million");
+
+  // The padding crosses the block boundary at 56 bytes.
+  check(hash(std::string(55, 'x')) != hash(std::string(56, 'x')), "sha1 padding");
+
+  // RFC 4648 test vectors.
+  check(encode("") == "", "base64 empty");
+  check(encode("f") == "Zg==", "base64 f");
+  check(encode("fo") == "Zm8=", "base64 fo");
+  check(encode("foo") == "Zm9v", "base64 foo");
+  check(encode("foob") == "Zm9vYg==", "base64 foob");
+  check(encode("fooba") == "Zm9vYmE=", "base64 fooba");
+  check(encode("foobar") == "Zm9vYmFy", "base64 foobar");
+
+  // The device decodes what the host encodes.
+  {
+    std::vector<uint8_t> data(8 * 1024);
+    srand(1);
+    for (auto& b : data)
+      b = rand();
+
+    static uint32_t block[2048];
+    bool            success = true;
+    for (size_t size = 0; size <= data.size(); size += 511) {
+      const std::string text = V2DeviceHost::encodeBase64(data.data(), size);
+      uint32_t          len;
+      if (!V2DeviceBase64::decode(text.data(), text.size(), block, sizeof(block), &len) || len != size ||
+          memcmp(block, data.data(), size) != 0)
+        success = false;
+    }
+
+    check(success, "base64 device decoder");
+  }
+
+  check(V2DeviceHost::escapeJSON("{\"name\":\"plain\"}") == "{\"name\":\"plain\"}", "escape ascii");
+  check(V2DeviceHost::escapeJSON("caf\xc3\xa9") == "caf\\u00e9", "escape two bytes");
+  check(V2DeviceHost::escapeJSON("\xe2\x82\xac") == "\\u20ac", "escape three bytes");
+  check(V2DeviceHost::escapeJSON("\xf0\x9f\x98\x80") == "\\ud83d\\ude00", "escape surrogate pair");
+  check(V2DeviceHost::escapeJSON("a\xe2\x82") == "a", "escape truncated sequence");
+
+  {
+    const std::vector<uint8_t> stream{
+      0x90, 0x40, 0x7f,                   // Note On, ignored
+      0xf0, 0x7d, '{', 0xf8, '}', 0xf7,   // Clock inside the message
+      0xf0, 0x7d, '{', 0x80, 0x40, 0x00,  // Aborted by a Note Off
+      0xf0, 0x7d, '[', ']', 0xf7,         // Second message
+    };
+
+    for (size_t chunk = 1; chunk <= stream.size(); chunk++) {
+      const auto messages = parse(stream, chunk);
+      check(messages.size() == 2, "sysex message count");
+      if (messages.size() != 2)
+        break;
+
+      check(messages[0] == std::vector<uint8_t>({0xf0, 0x7d, '{', '}', 0xf7}), "sysex realtime");
+      check(messages[1] == std::vector<uint8_t>({0xf0, 0x7d, '[', ']', 0xf7}), "sysex after abort");
+    }
+  }
+
+  // Every size round-trips through the packets; 13 bytes fit into one packet.
+  {
+    bool success = true;
+    for (size_t size = 0; size <= 8 * 1024; size += size < 100 ? 1 : 1021) {
+      std::vector<uint8_t> data(size);
+      for (size_t i = 0; i < size; i++)
+        data[i] = i * 7;
+
+      const auto packets = V2DeviceHost::packSysEx8(data.data(), size);
+      if (packets.size() != 4 * std::max<size_t>(1, (size + 12) / 13))
+        success = false;
+
+      V2DeviceHost::SysEx8Parser parser;
+      std::vector<uint8_t>       message;
+      uint32_t                   count = 0;
+      for (auto word : packets)
+        count += parser.parse(word, message);
+
+      if (count != 1 || message != data)
+        success = false;
+    }
+
+    check(success, "sysex8 round trip");
+  }
+
+  {
+    const uint8_t data[20]{0x7d, 0x00, 0xff};
+    const auto    packets = V2DeviceHost::packSysEx8(data, sizeof(data), 3, 0x42);
+    check(packets.size() == 8, "sysex8 packet count");
+    check(packets[0] == 0x531e427d, "sysex8 start");
+    check(packets[1] == 0x00ff0000, "sysex8 data");
+    check(packets[4] == 0x53384200, "sysex8 end");
+
+    // A Note On packet of one word and an aborted message are skipped.
+    V2DeviceHost::SysEx8Parser parser;
+    std::vector<uint8_t>       message;
+    bool                       complete = parser.parse(0x20904064, message);
+    for (uint8_t i = 4; i < 8; i++)
+      complete |= parser.parse(packets[i], message);
+    check(!complete, "sysex8 end without start");
+
+    for (auto word : packets)
+      complete = parser.parse(word, message);
+    check(complete && message == std::vector<uint8_t>(data, data + sizeof(data)), "sysex8 after abort");
+  }
+
+  if (failed > 0)
+    return 1;
+
+  printf("All tests passed.\n");
+  return 0;
+}
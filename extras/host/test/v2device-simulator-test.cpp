@@ -0,0 +1,94 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+// Test the client and the fleet updater against simulated devices: update the
+// firmware of all devices, write their configuration and read it back. The
+// devices are connected with MIDI 1.0 and with 8-bit SystemExclusive (UMP).
+//
+// Usage: v2device-simulator-test
+#include "../V2DeviceClient.h"
+#include "../simulator/V2DeviceSimulator.h"
+#include <cstdio>
+#include <random>
+
+static uint32_t failed = 0;
+
+static void check(bool condition, const std::string& test) {
+  if (condition)
+    return;
+
+  printf("FAIL: %s\n", test.c_str());
+  failed++;
+}
+
+static void test(bool ump) {
+  const std::string name = ump ? "ump " : "midi ";
+
+  V2DeviceHost::Simulator::Options options;
+  options.devices = 3;
+  options.ump     = ump;
+  V2DeviceHost::Simulator simulator(options);
+
+  V2DeviceHost::Fleet fleet(options.devices);
+  for (uint32_t i = 0; i < options.devices; i++)
+    fleet.add(simulator.connect(i));
+
+  // An image which is not a multiple of the packet size.
+  std::vector<uint8_t> image(40 * 1024 + 123);
+  std::mt19937         random(2);
+  for (auto& b : image)
+    b = random();
+
+  const std::string hash = V2DeviceHost::Client::hash(image.data(), image.size());
+
+  for (const auto& result : fleet.updateFirmware(image, "com.versioduo.simulator"))
+    check(result.success, name + result.name + " update: " + result.error);
+
+  // A different firmware id is skipped.
+  for (const auto& result : fleet.updateFirmware(image, "com.versioduo.other"))
+    check(!result.success && result.error == "differentFirmware", name + result.name + " different id");
+
+  const auto results = fleet.run([&](V2DeviceHost::Client& client) {
+    // The devices have rebooted with the new image.
+    JsonDocument reply;
+    if (!client.getAll(reply))
+      return false;
+
+    if (reply["com.versioduo.device"]["system"]["firmware"]["hash"] != hash) {
+      client.setError("hashMismatch");
+      return false;
+    }
+
+    JsonDocument configuration;
+    configuration["channel"] = 5;
+    configuration["text"]    = "Caf\xc3\xa9";
+    if (!client.writeConfiguration(configuration.as<JsonObjectConst>(), reply))
+      return false;
+
+    // Read the configuration back with a new request.
+    if (!client.getAll(reply))
+      return false;
+
+    JsonObject jsonConfiguration = reply["com.versioduo.device"]["configuration"];
+    if (jsonConfiguration["channel"] != 5 || jsonConfiguration["text"] != "Caf\xc3\xa9") {
+      client.setError("configurationMismatch");
+      return false;
+    }
+
+    return true;
+  });
+
+  for (const auto& result : results)
+    check(result.success, name + result.name + " verify: " + result.error);
+}
+
+int main() {
+  test(false);
+  test(true);
+
+  if (failed > 0)
+    return 1;
+
+  printf("All tests passed.\n");
+  return 0;
+}
@@ -0,0 +1,60 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+// Print the size of every section of the "getAll" reply of all devices. The
+// exit code is non-zero if a reply exceeds the device's budget.
+//
+// Usage: v2device-budget [hw:X,Y,Z ...]
+#include "V2DeviceClient.h"
+#include <iostream>
+#include <map>
+
+int main(int argc, char** argv) {
+  std::vector<std::string> names;
+  for (int i = 1; i < argc; i++)
+    names.push_back(argv[i]);
+
+  if (names.empty())
+    names = V2DeviceHost::RawMIDI::list();
+
+  V2DeviceHost::Fleet fleet(8);
+  for (const auto& name : names) {
+    auto midi = std::make_unique<V2DeviceHost::RawMIDI>(name);
+    if (!midi->open()) {
+      std::cerr << name << ": unable to open" << std::endl;
+      continue;
+    }
+
+    fleet.add(std::move(midi));
+  }
+
+  // Created in advance, the threads only access their own entry.
+  std::map<std::string, JsonDocument> reports;
+  for (const auto& name : names)
+    reports[name];
+
+  const auto results = fleet.run([&](V2DeviceHost::Client& client) {
+    return client.checkReplyBudget(reports.find(client.getTransport()->getName())->second);
+  });
+
+  int failed = 0;
+  for (const auto& result : results) {
+    JsonDocument& report = reports[result.name];
+    std::cout << result.name << ": " << report["size"].as<uint32_t>() << " of " << report["budget"].as<uint32_t>()
+              << " bytes";
+
+    if (!result.success) {
+      std::cout << ", " << result.error;
+      failed++;
+    }
+
+    std::cout << std::endl;
+
+    // The serialized and the escaped size.
+    for (JsonPair section : report["sections"].as<JsonObject>())
+      std::cout << "  " << section.key().c_str() << ": " << section.value()[0].as<uint32_t>() << " / "
+                << section.value()[1].as<uint32_t>() << std::endl;
+  }
+
+  return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,270 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+// Send requests to all devices in parallel for the given time, and print the
+// throughput, the latency distribution and the peak RAM usage of every device.
+// It exits with a non-zero code if a request has failed.
+//
+// Usage: v2device-load <seconds> <poll|ping|configure|children|upload> [--throttle <bytes/s> <msec>]
+//                      [--simulate <devices> [<children>]] [--link <bytes/s> <msec>] [--ump]
+//                      [hw:X,Y,Z ...]
+//
+//   poll:      getAll in a tight loop, like a misbehaving host script.
+//   ping:      the "ping" method; measures the transport without the SysEx handling.
+//   configure: a configure-app session; getAll, then writeConfiguration with the
+//              current configuration, repeated.
+//   children:  getChildren; the device collects the state of its children over the link.
+//   upload:    firmware updates with a new image every time; real devices reconnect
+//              with a different name after the update, it is meant for simulated devices.
+//
+// With --simulate, virtual devices running the library are used instead of the
+// hardware; --throttle sets the rate of their USB connection, --link the rate of
+// the link to their children. With --ump, the simulated devices have a USB MIDI
+// 2.0 endpoint; the messages are sent as 8-bit SystemExclusive (SysEx8).
+#include "V2DeviceClient.h"
+#include "simulator/V2DeviceSimulator.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+
+struct Statistics {
+  std::vector<uint32_t> usec;
+  uint64_t              bytes{};
+  uint32_t              errors{};
+
+  // The peak usage reported by the device, system.hardware.ram.peak.
+  uint32_t stack{};
+  uint32_t heap{};
+};
+
+static void updatePeak(Statistics& statistics, JsonDocument& reply) {
+  JsonObject peak = reply["com.versioduo.device"]["system"]["hardware"]["ram"]["peak"];
+  if (!peak)
+    return;
+
+  statistics.stack = std::max(statistics.stack, peak["stack"].as<uint32_t>());
+  statistics.heap  = std::max(statistics.heap, peak["heap"].as<uint32_t>());
+}
+
+static bool measure(V2DeviceHost::Client& client, Statistics& statistics, std::function<bool(JsonDocument&)> request) {
+  const auto   start = std::chrono::steady_clock::now();
+  JsonDocument reply;
+  if (!request(reply)) {
+    statistics.errors++;
+    return false;
+  }
+
+  statistics.usec.push_back(
+    std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+  statistics.bytes += client.getReplySize();
+
+  updatePeak(statistics, reply);
+  return true;
+}
+
+// Upload a new image and wait for the device to reboot; the duration of the
+// entire update is recorded.
+static bool upload(V2DeviceHost::Client& client, Statistics& statistics, uint32_t count) {
+  std::vector<uint8_t> image(64 * 1024);
+  std::mt19937         random(count);
+  for (auto& byte : image)
+    byte = random();
+
+  const auto start = std::chrono::steady_clock::now();
+  if (!client.writeFirmware(image)) {
+    statistics.errors++;
+    return false;
+  }
+
+  JsonDocument reply;
+  for (uint8_t i = 0;; i++) {
+    if (client.getAll(reply))
+      break;
+
+    if (i == 10) {
+      statistics.errors++;
+      return false;
+    }
+  }
+
+  statistics.usec.push_back(
+    std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+  statistics.bytes += image.size();
+  updatePeak(statistics, reply);
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0]
+              << " <seconds> <poll|ping|configure|children|upload> [--throttle <bytes/s> <msec>]"
+                 " [--simulate <devices> [<children>]] [--link <bytes/s> <msec>] [--ump] [hw:X,Y,Z ...]"
+              << std::endl;
+    return 1;
+  }
+
+  const uint32_t    seconds = atoi(argv[1]);
+  const std::string mode    = argv[2];
+
+  uint32_t                         bytesPerSecond = 0;
+  uint32_t                         latencyMs      = 0;
+  bool                             simulated      = false;
+  V2DeviceHost::Simulator::Options simulate{};
+  std::vector<std::string>         names;
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--throttle") == 0 && i + 2 < argc) {
+      bytesPerSecond = atoi(argv[++i]);
+      latencyMs      = atoi(argv[++i]);
+      continue;
+    }
+
+    if (strcmp(argv[i], "--simulate") == 0 && i + 1 < argc) {
+      simulated        = true;
+      simulate.devices = atoi(argv[++i]);
+      if (i + 1 < argc && isdigit(argv[i + 1][0]))
+        simulate.children = atoi(argv[++i]);
+
+      continue;
+    }
+
+    if (strcmp(argv[i], "--link") == 0 && i + 2 < argc) {
+      simulate.link.bytesPerSecond = atoi(argv[++i]);
+      simulate.link.latencyMs      = atoi(argv[++i]);
+      continue;
+    }
+
+    if (strcmp(argv[i], "--ump") == 0) {
+      simulate.ump = true;
+      continue;
+    }
+
+    names.push_back(argv[i]);
+  }
+
+  std::unique_ptr<V2DeviceHost::Simulator>            simulator;
+  std::vector<std::unique_ptr<V2DeviceHost::RawMIDI>> devices;
+  std::vector<std::string>                            opened;
+  if (simulated) {
+    simulate.usb = {bytesPerSecond, latencyMs};
+    simulator    = std::make_unique<V2DeviceHost::Simulator>(simulate);
+
+  } else {
+    if (names.empty())
+      names = V2DeviceHost::RawMIDI::list();
+
+    for (const auto& name : names) {
+      auto midi = std::make_unique<V2DeviceHost::RawMIDI>(name);
+      if (!midi->open()) {
+        std::cerr << name << ": unable to open" << std::endl;
+        continue;
+      }
+
+      opened.push_back(name);
+      devices.push_back(std::move(midi));
+    }
+  }
+
+  V2DeviceHost::Fleet fleet(simulated ? simulate.devices : devices.size());
+  if (simulated) {
+    for (uint32_t i = 0; i < simulate.devices; i++) {
+      auto transport = simulator->connect(i);
+      opened.push_back(transport->getName());
+      fleet.add(std::move(transport));
+    }
+
+  } else {
+    for (auto& device : devices)
+      fleet.add(std::make_unique<V2DeviceHost::Throttle>(device.get(), bytesPerSecond, latencyMs));
+  }
+
+  // Created in advance, the threads only access their own entry.
+  std::map<std::string, Statistics> statistics;
+  for (const auto& name : opened)
+    statistics[name];
+
+  const auto end     = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+  const auto results = fleet.run([&](V2DeviceHost::Client& client) {
+    Statistics& s     = statistics.find(client.getTransport()->getName())->second;
+    uint32_t    nonce = 0;
+    uint32_t    image = 0;
+
+    while (std::chrono::steady_clock::now() < end) {
+      if (mode == "ping") {
+        measure(client, s, [&](JsonDocument& reply) {
+          JsonDocument json;
+          json["method"] = "ping";
+          json["nonce"]  = ++nonce;
+          return client.request(json.as<JsonObjectConst>(), reply);
+        });
+
+      } else if (mode == "configure") {
+        JsonDocument state;
+        if (!measure(client, s, [&](JsonDocument& reply) {
+              bool success = client.getAll(reply);
+              state        = reply;
+              return success;
+            }))
+          continue;
+
+        for (uint8_t i = 0; i < 4; i++) {
+          measure(client, s, [&](JsonDocument& reply) {
+            return client.writeConfiguration(state["com.versioduo.device"]["configuration"], reply);
+          });
+        }
+
+      } else if (mode == "children") {
+        measure(client, s, [&](JsonDocument& reply) {
+          JsonDocument json;
+          json["method"] = "getChildren";
+          return client.request(json.as<JsonObjectConst>(), reply, 5000);
+        });
+
+      } else if (mode == "upload") {
+        upload(client, s, ++image);
+
+      } else {
+        measure(client, s, [&](JsonDocument& reply) {
+          return client.getAll(reply);
+        });
+      }
+    }
+
+    return s.errors == 0;
+  });
+
+  uint32_t errors = 0;
+  for (size_t i = 0; i < results.size(); i++) {
+    Statistics& s = statistics[results[i].name];
+    errors += s.errors;
+    std::sort(s.usec.begin(), s.usec.end());
+
+    std::cout << results[i].name << ": " << s.usec.size() << " requests";
+    if (!s.usec.empty()) {
+      auto percentile = [&](uint32_t p) {
+        return s.usec[std::min<size_t>(s.usec.size() - 1, s.usec.size() * p / 100)];
+      };
+
+      std::cout << ", " << s.usec.size() / std::max(1u, seconds) << "/s";
+      std::cout << ", " << s.bytes / std::max(1u, seconds) << " bytes/s";
+      std::cout << ", latency p50 " << percentile(50) << " usec, p99 " << percentile(99) << " usec, max "
+                << s.usec.back() << " usec";
+    }
+
+    if (s.heap > 0)
+      std::cout << ", peak heap " << s.heap << " bytes";
+
+    if (s.stack > 0)
+      std::cout << ", peak stack " << s.stack << " bytes";
+
+    if (s.errors > 0)
+      std::cout << ", " << s.errors << " errors";
+
+    std::cout << std::endl;
+  }
+
+  return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,60 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+// Update the firmware of all connected devices with the given firmware id.
+//
+// Usage: v2device-update <firmware.bin> <id> [hw:X,Y,Z ...]
+#include "V2DeviceClient.h"
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " <firmware.bin> <id> [hw:X,Y,Z ...]" << std::endl;
+    return 1;
+  }
+
+  std::ifstream file(argv[1], std::ios::binary);
+  if (!file) {
+    std::cerr << "Unable to open " << argv[1] << std::endl;
+    return 1;
+  }
+
+  const std::vector<uint8_t> image((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+  std::vector<std::string> names;
+  for (int i = 3; i < argc; i++)
+    names.push_back(argv[i]);
+
+  if (names.empty())
+    names = V2DeviceHost::RawMIDI::list();
+
+  V2DeviceHost::Fleet fleet(8);
+  for (const auto& name : names) {
+    auto midi = std::make_unique<V2DeviceHost::RawMIDI>(name);
+    if (!midi->open()) {
+      std::cerr << name << ": unable to open" << std::endl;
+      continue;
+    }
+
+    fleet.add(std::move(midi));
+  }
+
+  const auto results = fleet.updateFirmware(image, argv[2], [&](const std::string& name, uint32_t offset) {
+    std::cerr << name << ": " << (offset * 100 / image.size()) << "%" << std::endl;
+  });
+
+  int failed = 0;
+  for (const auto& result : results) {
+    if (result.success) {
+      std::cout << result.name << ": success (" << result.msec << " ms)" << std::endl;
+
+    } else if (result.error != "differentFirmware") {
+      std::cout << result.name << ": " << result.error << std::endl;
+      failed++;
+    }
+  }
+
+  return failed > 0 ? 1 : 0;
+}
@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "V2Device.h"
+#include "V2DeviceBase64.h"
 #include <V2Base.h>
 
 // This is only initialized after a cold startup when the memory is undefined.
@@ -16,6 +17,7 @@ public:
       return;
 
     clear();
+    memset(&firmware, 0, sizeof(firmware));
     _magic = 0x8f734e41;
   }
 
@@ -30,10 +32,111 @@ public:
     } ports;
   } usb;
 
+  // The progress of a firmware upload, to resume it after a disconnect or reboot.
+  struct {
+    // The hash of the entire image, provided by the host.
+    char hash[41];
+
+    // The end of the blocks which have been written without a gap.
+    uint32_t offset;
+  } firmware;
+
 private:
   uint32_t _magic;
 } bootData __attribute__((section(".noinit")));
 
+#if V2DEVICE_STATISTICS
+// Counts the heap memory used by the JSON documents for the RAM statistics.
+// Every allocation carries a header with its size, to account for it when it
+// is released.
+static class JSONAllocator : public ArduinoJson::Allocator {
+public:
+  uint32_t used{};
+  uint32_t peak{};
+
+  void* allocate(size_t size) override {
+    uint32_t* block = (uint32_t*)malloc(header + size);
+    if (!block)
+      return nullptr;
+
+    account(block, size);
+    return (uint8_t*)block + header;
+  }
+
+  void deallocate(void* pointer) override {
+    if (!pointer)
+      return;
+
+    uint32_t* block = (uint32_t*)((uint8_t*)pointer - header);
+    used -= block[0];
+    free(block);
+  }
+
+  void* reallocate(void* pointer, size_t size) override {
+    if (!pointer)
+      return allocate(size);
+
+    uint32_t*      block = (uint32_t*)((uint8_t*)pointer - header);
+    const uint32_t old   = block[0];
+    block                = (uint32_t*)realloc(block, header + size);
+    if (!block)
+      return nullptr;
+
+    used -= old;
+    account(block, size);
+    return (uint8_t*)block + header;
+  }
+
+private:
+  // Keep the alignment of the returned memory.
+  static constexpr uint32_t header = 8;
+
+  void account(uint32_t* block, uint32_t size) {
+    block[0] = size;
+    used += size;
+    if (used > peak)
+      peak = used;
+  }
+} jsonAllocator;
+#else
+// Without the statistics, the documents use the default allocator of ArduinoJson.
+static ArduinoJson::Allocator& jsonAllocator = *ArduinoJson::detail::DefaultAllocator::instance();
+#endif
+
+#if V2DEVICE_STATISTICS && defined(__arm__)
+// The unused stack is filled with a pattern; the deepest overwritten word
+// marks the peak stack usage.
+extern "C" char* sbrk(int incr);
+extern uint32_t  __StackTop;
+static constexpr uint32_t stackPattern = 0xa5a5a5a5;
+static uint32_t*          stackPainted{};
+
+// The start of the painted area; the heap might have grown into it.
+static uint32_t* getStackBottom() {
+  uint32_t* heap = (uint32_t*)(((uintptr_t)sbrk(0) + 3) & ~3);
+  return heap > stackPainted ? heap : stackPainted;
+}
+
+// Paint the area between the heap and the current stack pointer, leaving
+// space for the frames of the called functions.
+static void __attribute__((noinline)) paintStack(uint32_t* from) {
+  uint32_t  marker;
+  uint32_t* to = &marker - 64;
+  for (uint32_t* p = from; p < to; p++)
+    *p = stackPattern;
+}
+
+// Returns the peak stack usage since the last paint, and paints the used area again.
+static uint32_t measureStack() {
+  uint32_t* p = getStackBottom();
+  while (p < &__StackTop && *p == stackPattern)
+    p++;
+
+  paintStack(p);
+  return (uintptr_t)&__StackTop - (uintptr_t)p;
+}
+#endif
+
 bool V2Device::readEEPROM(bool dryrun) {
   struct EEPROM* eeprom = (struct EEPROM*)V2Base::Memory::EEPROM::getStart();
   // Check our magic, all bytes are 0xff after chip erase.
@@ -70,6 +173,17 @@ bool V2Device::readEEPROM(bool dryrun) {
 }
 
 void V2Device::begin() {
+  uint32_t usec    = V2Base::getUsec();
+  _boot.usec.start = usec;
+
+  // The duration of a step, measured from the end of the previous one.
+  auto measure = [&usec]() {
+    const uint32_t now      = V2Base::getUsec();
+    const uint32_t duration = now - usec;
+    usec                    = now;
+    return duration;
+  };
+
   V2MIDI::Port::begin();
   usb.midi.begin();
 
@@ -83,12 +197,12 @@ void V2Device::begin() {
     V2Base::Memory::Firmware::reboot();
   }
 
-  _boot.id = V2Base::Cryptography::Random::read();
+  _boot.id            = V2Base::Cryptography::Random::read();
+  _boot.usec.userPage = measure();
 
   // Do not block in GetAll(), it takes ~80ms.
-  V2Base::Memory::Firmware::calculateHash(V2Base::Memory::Firmware::getStart(),
-                                          V2Base::Memory::Firmware::getSize(),
-                                          _firmware.hash);
+  if (!system.fastBoot)
+    hashFirmware();
 
   // Read a possible config from the previous boot cycle.
   if (bootData.usb.ports.enableAccess)
@@ -96,28 +210,65 @@ void V2Device::begin() {
 
   bootData.clear();
 
-#ifdef PIN_REVISION_BITS
-  // The revision number is composed of pins which are either floating or
-  // connected to ground. A ground connection represents a logical high.
-  {
-    for (uint8_t i = 0; i < PIN_REVISION_BITS; i++)
-      pinMode(PIN_REVISION + i, INPUT_PULLUP);
+  measure();
+  if (!system.fastBoot) {
+    readRevision();
+    _boot.usec.revision = measure();
+  }
 
-    for (uint8_t i = 0; i < PIN_REVISION_BITS; i++) {
-      if (digitalRead(PIN_REVISION + i))
-        continue;
+  readEEPROM();
+  _boot.usec.eeprom = measure();
 
-      system.revision |= 1 << i;
-    }
+  handleInit();
+  _boot.usec.init = measure();
+
+  attachUSB();
+  _boot.usec.usb = measure();
 
-    for (uint8_t i = 0; i < PIN_REVISION_BITS; i++)
-      pinMode(PIN_REVISION + i, INPUT);
+  // The USB device is connected; read what is not needed to initialize the device.
+  if (system.fastBoot) {
+    readRevision();
+    _boot.usec.revision = measure();
   }
+
+#if V2DEVICE_STATISTICS && defined(__arm__)
+  stackPainted = (uint32_t*)(((uintptr_t)sbrk(0) + 3) & ~3);
+  paintStack(stackPainted);
 #endif
 
-  readEEPROM();
-  handleInit();
+  // Sleep mode IDLE, wait for interrupts.
+  V2Base::Power::setSleepMode(V2Base::Power::Mode::Idle);
+}
 
+void V2Device::hashFirmware() {
+  const uint32_t usec = V2Base::getUsec();
+  V2Base::Memory::Firmware::calculateHash(V2Base::Memory::Firmware::getStart(),
+                                          V2Base::Memory::Firmware::getSize(),
+                                          _firmware.hash);
+  _boot.usec.hash = V2Base::getUsec() - usec;
+}
+
+void V2Device::readRevision() {
+#if V2DEVICE_REVISION && defined(PIN_REVISION_BITS)
+  // The revision number is composed of pins which are either floating or
+  // connected to ground. A ground connection represents a logical high.
+  for (uint8_t i = 0; i < PIN_REVISION_BITS; i++)
+    pinMode(PIN_REVISION + i, INPUT_PULLUP);
+
+  for (uint8_t i = 0; i < PIN_REVISION_BITS; i++) {
+    if (digitalRead(PIN_REVISION + i))
+      continue;
+
+    system.revision |= 1 << i;
+  }
+
+  for (uint8_t i = 0; i < PIN_REVISION_BITS; i++)
+    pinMode(PIN_REVISION + i, INPUT);
+#endif
+}
+
+// Configure the USB device from the current settings and connect to the host.
+void V2Device::attachUSB() {
   usb.midi.setVendor(metadata.vendor);
 
   // Set USB device name, the default is provided by the board package, the metadata
@@ -135,6 +286,8 @@ void V2Device::begin() {
     usb.ports.current = _eeprom.usb.ports;
   else if (usb.ports.standard > 0)
     usb.ports.current = usb.ports.standard;
+  else
+    usb.ports.current = 1;
 
   if (usb.ports.current > 1)
     usb.midi.setPorts(usb.ports.current);
@@ -150,9 +303,6 @@ void V2Device::begin() {
 
   usb.midi.setVersion(V2DeviceMetadata.version);
   usb.midi.attach();
-
-  // Sleep mode IDLE, wait for interrupts.
-  V2Base::Power::setSleepMode(V2Base::Power::Mode::Idle);
 }
 
 void V2Device::reset() {
@@ -163,12 +313,324 @@ void V2Device::reset() {
 
 void V2Device::loop() {
   led.loop();
-  loopSystemExclusive();
+
+  const uint32_t pending = loopSystemExclusive();
+
+#if V2DEVICE_STATISTICS
+  if (pending == 0)
+    _output.reply.queued = false;
+
+  sampleOutput(&_output.reply.queue, pending > 0);
+  sampleOutput(&_output.usb, !usb.midi.idle());
+#if V2DEVICE_SERIAL
+  if (serial)
+    sampleOutput(&_output.serial, !serial->idle());
+#endif
+#if V2DEVICE_LINK
+  if (link && link->plug)
+    sampleOutput(&_output.plug, !link->plug->idle());
+
+  if (link && link->socket)
+    sampleOutput(&_output.socket, !link->socket->idle());
+#endif
+#endif
+
+  // Record the time when the reply to a "ping" has left the USB queue.
+  if (pending == 0 && _latency.ping.pending && usb.midi.idle()) {
+    _latency.ping.drain   = V2Base::getUsec();
+    _latency.ping.pending = false;
+  }
+
+  // Connect again after the host has noticed the disconnect.
+  if (_reconnect.usec > 0 && (uint32_t)(V2Base::getUsec() - _reconnect.usec) > 100 * 1000) {
+    _reconnect.usec = 0;
+    usb.midi.setPorts(1);
+    attachUSB();
+  }
+
+#if V2DEVICE_LINK
+  // Reply with the children which have answered so far.
+  if (_children.json && (uint32_t)(V2Base::getUsec() - _children.usec) > 1000 * 1000)
+    sendChildren();
+#endif
+
+#if V2DEVICE_FIRMWARE && V2DEVICE_LINK
+  // Give up on the children which have not acknowledged the firmware packet.
+  if (_relay.pending && (uint32_t)(V2Base::getUsec() - _relay.usec) > 2000 * 1000) {
+    for (uint8_t i = 1; i < 16; i++) {
+      if (!(_relay.pending & (1 << i)))
+        continue;
+
+      _relay.status[i] = "timeout";
+      _relay.children &= ~(1 << i);
+    }
+
+    _relay.pending = 0;
+    sendRelayStatus();
+  }
+#endif
+
   handleLoop();
 }
 
+// Send the reply to the current request, record the time it took to handle it.
+void V2Device::sendRequestReply(V2MIDI::Transport* transport, uint32_t len) {
+#if V2DEVICE_STATISTICS
+  if (_latency.active) {
+    const uint32_t usec = V2Base::getUsec();
+
+    uint8_t bucket = 0;
+    for (uint32_t limit = 128; (uint32_t)(usec - _latency.usec) >= limit; limit <<= 1) {
+      if (bucket == V2Base::countof(_latency.histogram) - 1)
+        break;
+
+      bucket++;
+    }
+    _latency.histogram[bucket]++;
+    _latency.active = false;
+  }
+#endif
+
+#if V2DEVICE_STATISTICS
+  // The previous reply has not been sent completely; it is replaced.
+  if (_output.reply.queued)
+    _output.reply.queue.dropped++;
+
+  _output.reply.queued = true;
+  if (len > _output.reply.largest)
+    _output.reply.largest = len;
+#endif
+
+  // Send the payload without the 0xf0/0xf7 framing.
+  if (transport == _sysex8) {
+    if (!sendSystemExclusive8(transport, getSystemExclusiveBuffer() + 1, len - 2))
+      countDropped(transport);
+
+    return;
+  }
+
+  if (!sendSystemExclusive(transport, len))
+    countDropped(transport);
+}
+
+void V2Device::countDropped(V2MIDI::Transport* transport) {
+#if V2DEVICE_STATISTICS
+  Output* output = &_output.other;
+  if (transport == &usb.midi)
+    output = &_output.usb;
+#if V2DEVICE_SERIAL
+  else if (serial && transport == serial)
+    output = &_output.serial;
+#endif
+#if V2DEVICE_LINK
+  else if (link && transport == link->plug)
+    output = &_output.plug;
+  else if (link && transport == link->socket)
+    output = &_output.socket;
+#endif
+
+  output->dropped++;
+#endif
+}
+
+#if V2DEVICE_STATISTICS
+// Measure the time a queue is not empty, sampled in loop().
+void V2Device::sampleOutput(Output* output, bool busy) {
+  const uint32_t usec = V2Base::getUsec();
+
+  if (busy) {
+    if (output->usec == 0)
+      output->usec = usec;
+
+    return;
+  }
+
+  if (output->usec == 0)
+    return;
+
+  const uint32_t duration = usec - output->usec;
+  output->usec            = 0;
+  if (duration < 100 * 1000)
+    return;
+
+  output->stalls++;
+  if (duration > output->longest)
+    output->longest = duration;
+}
+
+void V2Device::addOutput(JsonObject json, const Output* output) {
+  if (output->stalls == 0 && output->dropped == 0 && output->usec == 0)
+    return;
+
+  JsonObject jsonQueue = json["queue"].to<JsonObject>();
+  jsonQueue["stalls"]  = output->stalls;
+  jsonQueue["longest"] = output->longest;
+  jsonQueue["dropped"] = output->dropped;
+
+  // The queue is not draining at the moment.
+  if (output->usec > 0 && (uint32_t)(V2Base::getUsec() - output->usec) > 100 * 1000)
+    jsonQueue["stalled"] = (uint32_t)(V2Base::getUsec() - output->usec);
+}
+#endif
+
+// Echo the host's nonce with the device-side timestamps. The drain time of the
+// reply is not known when it is sent; the timestamps of the previous "ping" are
+// included to see where the time was spent.
+void V2Device::sendPing(V2MIDI::Transport* transport, uint32_t nonce) {
+  uint8_t* reply = getSystemExclusiveBuffer();
+  uint32_t len   = 0;
+
+  // 0x7d == SysEx research/private ID
+  reply[len++] = (uint8_t)V2MIDI::Packet::Status::SystemExclusive;
+  reply[len++] = 0x7d;
+
+  JsonDocument json(&jsonAllocator);
+  JsonObject   jsonDevice = json["com.versioduo.device"].to<JsonObject>();
+  jsonDevice["token"]     = _boot.id;
+  JsonObject jsonPing     = jsonDevice["ping"].to<JsonObject>();
+  jsonPing["nonce"]       = nonce;
+  jsonPing["receive"]     = _latency.usec;
+  jsonPing["send"]        = V2Base::getUsec();
+
+  if (_latency.ping.drain > 0) {
+    JsonObject jsonPrevious = jsonPing["previous"].to<JsonObject>();
+    jsonPrevious["nonce"]   = _latency.ping.nonce;
+    jsonPrevious["receive"] = _latency.ping.receive;
+    jsonPrevious["send"]    = _latency.ping.send;
+    jsonPrevious["drain"]   = _latency.ping.drain;
+  }
+
+  len += serializeJson(json, (char*)reply + len, 1024);
+  reply[len++] = (uint8_t)V2MIDI::Packet::Status::SystemExclusiveEnd;
+
+  _latency.ping.nonce   = nonce;
+  _latency.ping.receive = _latency.usec;
+  _latency.ping.send    = V2Base::getUsec();
+  _latency.ping.drain   = 0;
+  _latency.ping.pending = true;
+  sendRequestReply(transport, len);
+}
+
+#if V2DEVICE_STATISTICS
+void V2Device::handleClock(Clock clock) {
+  const uint32_t usec = V2Base::getUsec();
+
+  if (clock != Clock::Tick) {
+    _clock.usec  = 0;
+    _clock.index = 0;
+    _clock.count = 0;
+    return;
+  }
+
+  const uint32_t interval = usec - _clock.usec;
+  const uint32_t last     = _clock.usec;
+  _clock.usec             = usec;
+
+  // The first tick, or the clock was stopped without a Stop message.
+  if (last == 0 || interval > 1000 * 1000) {
+    _clock.index = 0;
+    _clock.count = 0;
+    return;
+  }
+
+  // Missing ticks; count them, but keep them out of the tempo calculation.
+  if (_clock.count == V2Base::countof(_clock.intervals)) {
+    uint32_t sum = 0;
+    for (uint8_t i = 0; i < _clock.count; i++)
+      sum += _clock.intervals[i];
+
+    const uint32_t mean = sum / _clock.count;
+    if (interval > mean + mean / 2) {
+      _clock.dropout += (interval + mean / 2) / mean - 1;
+      return;
+    }
+  }
+
+  _clock.intervals[_clock.index] = interval;
+  _clock.index                   = (_clock.index + 1) % V2Base::countof(_clock.intervals);
+  if (_clock.count < V2Base::countof(_clock.intervals))
+    _clock.count++;
+}
+#endif
+
+// Send the pending reply while loop() is not called, before a reboot or a
+// blocking flash write.
+void V2Device::flushReply() {
+  uint32_t usec = V2Base::getUsec();
+  for (;;) {
+    if (loopSystemExclusive() == 0)
+      break;
+
+    if ((uint32_t)(V2Base::getUsec() - usec) > 100 * 1000)
+      break;
+
+    yield();
+  }
+}
+
+static const char* skipWhitespace(const char* text, const char* end) {
+  while (text < end && (*text == ' ' || *text == '\t' || *text == '\n' || *text == '\r'))
+    text++;
+
+  return text;
+}
+
+// Find the quoted member name followed by a value starting with the given
+// character; returns the position after it. JSON whitespace is skipped.
+static const char* findMember(const char* text, const char* end, const char* name, char value) {
+  const uint32_t len = strlen(name);
+
+  for (const char* member = text; (member = (const char*)memmem(member, end - member, name, len)); member += len) {
+    const char* c = skipWhitespace(member + len, end);
+    if (c == end || *c != ':')
+      continue;
+
+    c = skipWhitespace(c + 1, end);
+    if (c < end && *c == value)
+      return c + 1;
+  }
+
+  return NULL;
+}
+
+// Find the "data" string of a "firmware" or "region" object in the raw message.
+static const char* findData(const uint8_t* buffer, uint32_t len, uint32_t* dataLen) {
+  const char* end    = (const char*)buffer + len;
+  const char* object = findMember((const char*)buffer, end, "\"firmware\"", '{');
+  if (!object)
+    object = findMember((const char*)buffer, end, "\"region\"", '{');
+  if (!object)
+    return NULL;
+
+  const char* data = findMember(object, end, "\"data\"", '"');
+  if (!data)
+    return NULL;
+
+  const char* quote = (const char*)memchr(data, '"', end - data);
+  if (!quote)
+    return NULL;
+
+  *dataLen = quote - data;
+  return data;
+}
+
+// Decode the base64 data of a packet into a flash block, it needs to fit. The
+// raw data of an 8-bit message is copied.
+static bool decodeBlock(const char* data, uint32_t dataLen, bool raw, uint32_t* block, uint32_t* len) {
+  if (raw) {
+    if (!data || dataLen > V2Base::Memory::Flash::getBlockSize())
+      return false;
+
+    memcpy(block, data, dataLen);
+    *len = dataLen;
+    return true;
+  }
+
+  return V2DeviceBase64::decode(data, dataLen, block, V2Base::Memory::Flash::getBlockSize(), len);
+}
+
 // Reply with message to indicate that we are ready for the next packet.
-void V2Device::sendFirmwareStatus(V2MIDI::Transport* transport, const char* status) {
+void V2Device::sendFirmwareStatus(V2MIDI::Transport* transport, const char* status, const char* name) {
   uint8_t* reply = getSystemExclusiveBuffer();
   uint32_t len   = 0;
 
@@ -176,17 +638,52 @@ void V2Device::sendFirmwareStatus(V2MIDI::Transport* transport, const char* stat
   reply[len++] = (uint8_t)V2MIDI::Packet::Status::SystemExclusive;
   reply[len++] = 0x7d;
 
-  JsonDocument json;
+  JsonDocument json(&jsonAllocator);
   JsonObject   jsonDevice = json["com.versioduo.device"].to<JsonObject>();
   jsonDevice["token"]     = _boot.id;
-  JsonObject jsonFirmware = jsonDevice["firmware"].to<JsonObject>();
+  JsonObject jsonFirmware = jsonDevice[name].to<JsonObject>();
   jsonFirmware["status"]  = status;
   len += serializeJson(json, (char*)reply + len, 1024);
 
   reply[len++] = (uint8_t)V2MIDI::Packet::Status::SystemExclusiveEnd;
-  sendSystemExclusive(transport, len);
+  sendRequestReply(transport, len);
 }
 
+#if V2DEVICE_STATISTICS
+// Counts the length of the serialized JSON, and the length after the unicode
+// characters are escaped by escapeJSON().
+class JSONCounter {
+public:
+  uint32_t size{};
+  uint32_t escaped{};
+
+  size_t write(uint8_t c) {
+    size++;
+
+    // The leading byte of a UTF-8 sequence is replaced by one or two
+    // "\uXXXX" sequences, the continuation bytes are dropped.
+    if (c < 0x80)
+      escaped++;
+
+    else if (c >= 0xf0)
+      escaped += 12;
+
+    else if (c >= 0xc0)
+      escaped += 6;
+
+    return 1;
+  }
+
+  size_t write(const uint8_t* s, size_t n) {
+    for (size_t i = 0; i < n; i++)
+      write(s[i]);
+
+    return n;
+  }
+};
+#endif
+
+#if V2DEVICE_UNICODE
 static int8_t utf8Codepoint(const uint8_t* utf8, uint32_t* codepointp) {
   uint32_t codepoint;
   int8_t   len;
@@ -284,6 +781,7 @@ static uint32_t escapeJSON(const uint8_t* jsonBuffer, uint32_t jsonLen, uint8_t*
 
   return bufferLen;
 }
+#endif
 
 void addStatistics(JsonObject json, V2MIDI::Port::Counter* counter) {
   json["packet"] = counter->packet;
@@ -325,15 +823,8 @@ void addStatistics(JsonObject json, V2MIDI::Port::Counter* counter) {
 }
 
 // Send the current data as a SystemExclusive, JSON message.
-void V2Device::sendReply(V2MIDI::Transport* transport) {
-  uint8_t* reply = getSystemExclusiveBuffer();
-  uint32_t len   = 0;
-
-  // 0x7d == SysEx research/private ID
-  reply[len++] = (uint8_t)V2MIDI::Packet::Status::SystemExclusive;
-  reply[len++] = 0x7d;
-
-  JsonDocument json;
+void V2Device::sendReply(V2MIDI::Transport* transport, bool report) {
+  JsonDocument json(&jsonAllocator);
   JsonObject   jsonDevice = json["com.versioduo.device"].to<JsonObject>();
 
   // Requests and replies contain the device's current bootID.
@@ -382,10 +873,28 @@ void V2Device::sendReply(V2MIDI::Transport* transport) {
     if (usb.name)
       jsonSystem["name"] = usb.name;
 
+    jsonSystem["sequence"] = _state.sequence;
+
+    // Fast boot; the hash is calculated when it is first requested, the
+    // device does not stall in loop().
+    if (_firmware.hash[0] == '\0')
+      hashFirmware();
+
     {
       JsonObject jsonBoot = jsonSystem["boot"].to<JsonObject>();
       jsonBoot["uptime"]  = (uint32_t)(millis() / 1000);
       jsonBoot["id"]      = _boot.id;
+      if (system.fastBoot)
+        jsonBoot["fast"] = true;
+
+      JsonObject jsonUsec  = jsonBoot["usec"].to<JsonObject>();
+      jsonUsec["start"]    = _boot.usec.start;
+      jsonUsec["userPage"] = _boot.usec.userPage;
+      jsonUsec["hash"]     = _boot.usec.hash;
+      jsonUsec["revision"] = _boot.usec.revision;
+      jsonUsec["eeprom"]   = _boot.usec.eeprom;
+      jsonUsec["init"]     = _boot.usec.init;
+      jsonUsec["usb"]      = _boot.usec.usb;
     }
 
     {
@@ -406,13 +915,14 @@ void V2Device::sendReply(V2MIDI::Transport* transport) {
     {
       JsonObject jsonHardware = jsonSystem["hardware"].to<JsonObject>();
 
+#if V2DEVICE_FIRMWARE
       {
         // The end of the bootloader contains an array of four offsets/pointers.
         const uint32_t* info = (uint32_t*)V2Base::Memory::Firmware::getStart() - 4;
 
         // The first entry is the location of our metadata.
         const char*  metadata = (const char*)info[0];
-        JsonDocument jsonMetadata;
+        JsonDocument jsonMetadata(&jsonAllocator);
         if (deserializeJson(jsonMetadata, metadata))
           return;
 
@@ -425,6 +935,7 @@ void V2Device::sendReply(V2MIDI::Transport* transport) {
 
         jsonHardware["board"] = jsonBootloader["board"];
       }
+#endif
 
       if (system.revision > 0)
         jsonHardware["revision"] = system.revision;
@@ -433,6 +944,24 @@ void V2Device::sendReply(V2MIDI::Transport* transport) {
         JsonObject jsonRam = jsonHardware["ram"].to<JsonObject>();
         jsonRam["size"]    = V2Base::Memory::RAM::getSize();
         jsonRam["free"]    = V2Base::Memory::RAM::getFree();
+
+#if V2DEVICE_STATISTICS
+        if (_ram.methods[0].name[0] != '\0') {
+          JsonObject jsonPeak = jsonRam["peak"].to<JsonObject>();
+          jsonPeak["stack"]   = _ram.stack;
+          jsonPeak["heap"]    = _ram.heap;
+
+          JsonObject jsonMethods = jsonPeak["methods"].to<JsonObject>();
+          for (uint8_t i = 0; i < V2Base::countof(_ram.methods); i++) {
+            if (_ram.methods[i].name[0] == '\0')
+              break;
+
+            JsonObject jsonMethod = jsonMethods[(const char*)_ram.methods[i].name].to<JsonObject>();
+            jsonMethod["stack"]   = _ram.methods[i].stack;
+            jsonMethod["heap"]    = _ram.methods[i].heap;
+          }
+        }
+#endif
       }
 
       {
@@ -446,6 +975,11 @@ void V2Device::sendReply(V2MIDI::Transport* transport) {
         jsonEeprom["used"]    = readEEPROM(true);
       }
 
+      if (storage) {
+        JsonObject jsonStorage = jsonHardware["storage"].to<JsonObject>();
+        jsonStorage["size"]    = storage->getSize();
+      }
+
       {
         JsonObject jsonUsb = jsonHardware["usb"].to<JsonObject>();
         {
@@ -467,63 +1001,134 @@ void V2Device::sendReply(V2MIDI::Transport* transport) {
       }
     }
 
+#if V2DEVICE_STATISTICS
     JsonObject jsonMidi = jsonSystem["midi"].to<JsonObject>();
     {
       JsonObject jsonIn = jsonMidi["input"].to<JsonObject>();
       addStatistics(jsonIn, &_statistics.input);
 
+      if (_clock.count > 0 || _clock.dropout > 0) {
+        JsonObject jsonClock = jsonIn["clock"].to<JsonObject>();
+
+        if (_clock.count > 0) {
+          float mean = 0;
+          for (uint8_t i = 0; i < _clock.count; i++)
+            mean += _clock.intervals[i];
+          mean /= _clock.count;
+
+          float variance = 0;
+          float maximum  = 0;
+          for (uint8_t i = 0; i < _clock.count; i++) {
+            const float deviation = (float)_clock.intervals[i] - mean;
+            variance += deviation * deviation;
+            if (fabsf(deviation) > maximum)
+              maximum = fabsf(deviation);
+          }
+          variance /= _clock.count;
+
+          // 24 ticks per quarter note.
+          jsonClock["bpm"]        = 60.f * 1000.f * 1000.f / (mean * 24.f);
+          JsonObject jsonJitter   = jsonClock["jitter"].to<JsonObject>();
+          jsonJitter["deviation"] = (uint32_t)sqrtf(variance);
+          jsonJitter["max"]       = (uint32_t)maximum;
+        }
+
+        jsonClock["dropout"] = _clock.dropout;
+      }
+
       JsonObject jsonOut = jsonMidi["output"].to<JsonObject>();
       addStatistics(jsonOut, &_statistics.output);
+      addOutput(jsonOut, &_output.usb);
+
+      JsonObject jsonReply = jsonOut["reply"].to<JsonObject>();
+      jsonReply["largest"] = _output.reply.largest;
+      addOutput(jsonReply, &_output.reply.queue);
+
+      if (_output.other.dropped > 0)
+        jsonOut["dropped"] = _output.other.dropped;
     }
+#endif
 
+#if V2DEVICE_LINK
     if (link) {
       JsonObject jsonLink = jsonSystem["link"].to<JsonObject>();
       if (link->plug) {
         JsonObject jsonPlug = jsonLink["plug"].to<JsonObject>();
         jsonPlug["input"]   = link->plug->statistics.input;
         jsonPlug["output"]  = link->plug->statistics.output;
+#if V2DEVICE_STATISTICS
+        addOutput(jsonPlug, &_output.plug);
+#endif
       }
 
       if (link->socket) {
         JsonObject jsonSocket = jsonLink["socket"].to<JsonObject>();
         jsonSocket["input"]   = link->socket->statistics.input;
         jsonSocket["output"]  = link->socket->statistics.output;
+#if V2DEVICE_STATISTICS
+        addOutput(jsonSocket, &_output.socket);
+#endif
       }
     }
 
+#endif
+
+#if V2DEVICE_SERIAL
     if (serial) {
       JsonObject jsonSerial = jsonSystem["serial"].to<JsonObject>();
       jsonSerial["input"]   = serial->statistics.input;
       jsonSerial["output"]  = serial->statistics.output;
+#if V2DEVICE_STATISTICS
+      addOutput(jsonSerial, &_output.serial);
+#endif
     }
+#endif
 
-    exportSystem(jsonSystem);
-  }
+#if V2DEVICE_STATISTICS
+    if (_requests.rejected.nesting > 0 || _requests.rejected.members > 0 || _requests.rejected.string > 0) {
+      JsonObject jsonRejected = jsonSystem["requests"]["rejected"].to<JsonObject>();
+      jsonRejected["nesting"] = _requests.rejected.nesting;
+      jsonRejected["members"] = _requests.rejected.members;
+      jsonRejected["string"]  = _requests.rejected.string;
+    }
 
-  JsonArray settings = jsonDevice["settings"].to<JsonArray>();
-  exportSettings(settings);
+    if (_requests.slow > 0)
+      jsonSystem["requests"]["slow"] = _requests.slow;
 
-  {
-    JsonObject config  = jsonDevice["configuration"].to<JsonObject>();
-    config["#usb"]     = "USB Settings";
-    JsonObject jsonUsb = config["usb"].to<JsonObject>();
-    jsonUsb["#name"]   = "Device Name";
-    jsonUsb["name"]    = _eeprom.usb.name;
+    uint32_t dropped = _requests.dropped.usb + _requests.dropped.serial + _requests.dropped.other;
+    for (uint8_t i = 0; i < V2Base::countof(_requests.dropped.methods); i++)
+      dropped += _requests.dropped.methods[i];
 
-    jsonUsb["#vid"] = "USB Vendor ID";
-    jsonUsb["vid"]  = _eeprom.usb.vid;
+    if (dropped > 0) {
+      JsonObject jsonDropped = jsonSystem["requests"]["dropped"].to<JsonObject>();
+      jsonDropped["usb"]     = _requests.dropped.usb;
+      jsonDropped["serial"]  = _requests.dropped.serial;
+      jsonDropped["other"]   = _requests.dropped.other;
 
-    jsonUsb["#pid"] = "USB Product ID";
-    jsonUsb["pid"]  = _eeprom.usb.pid;
+      JsonObject jsonMethods = jsonDropped["methods"].to<JsonObject>();
+      for (uint8_t i = 0; i < V2Base::countof(limits.methods); i++) {
+        if (limits.methods[i].method)
+          jsonMethods[limits.methods[i].method] = _requests.dropped.methods[i];
+      }
+    }
 
-    if (usb.ports.standard > 0) {
-      jsonUsb["#ports"] = "Number of MIDI ports";
-      jsonUsb["ports"]  = _eeprom.usb.ports;
+    {
+      JsonObject jsonLatency = jsonSystem["latency"].to<JsonObject>();
+      jsonLatency["bucket"]  = 128;
+      JsonArray jsonBuckets  = jsonLatency["histogram"].to<JsonArray>();
+      for (uint8_t i = 0; i < V2Base::countof(_latency.histogram); i++)
+        jsonBuckets.add(_latency.histogram[i]);
     }
+#endif
 
-    exportConfiguration(config);
+    exportSystem(jsonSystem);
   }
 
+  JsonArray settings = jsonDevice["settings"].to<JsonArray>();
+  exportSettings(settings);
+
+  addConfiguration(jsonDevice["configuration"].to<JsonObject>());
+
   JsonObject input = jsonDevice["input"].to<JsonObject>();
   exportInput(input);
   if (input.begin() == input.end())
@@ -534,34 +1139,656 @@ void V2Device::sendReply(V2MIDI::Transport* transport) {
   if (output.begin() == output.end())
     jsonDevice.remove("output");
 
-  {
-    uint8_t  jsonBuffer[_sysexSize];
-    uint32_t jsonLen = serializeJson(json, (char*)jsonBuffer, _sysexSize);
-    len += escapeJSON(jsonBuffer, jsonLen, reply + len, _sysexSize - len);
+#if V2DEVICE_STATISTICS
+  if (report)
+    addReplyBudget(json);
+#endif
+  sendJSON(transport, json);
+}
+
+#if V2DEVICE_STATISTICS
+// Export the serialized and escaped size of every section of the reply. If
+// the reply does not fit into the SystemExclusive buffer, the large sections
+// are removed; the host still receives the report instead of an empty reply.
+// It serializes the reply several times, it is only added when the "getAll"
+// request asks for it with "report": true.
+void V2Device::addReplyBudget(JsonDocument& json) {
+  static const char* const sections[]{
+    "metadata", "links", "help", "system", "settings", "configuration", "input", "output",
+  };
+
+  JsonObject jsonDevice   = json["com.versioduo.device"];
+  JsonObject jsonReply    = jsonDevice["system"]["reply"].to<JsonObject>();
+  JsonObject jsonSections = jsonReply["sections"].to<JsonObject>();
+  for (uint8_t i = 0; i < V2Base::countof(sections); i++) {
+    JsonVariant jsonSection = jsonDevice[sections[i]];
+    if (jsonSection.isNull())
+      continue;
+
+    JSONCounter counter;
+    serializeJson(jsonSection, counter);
+
+    JsonArray jsonSize = jsonSections[sections[i]].to<JsonArray>();
+    jsonSize.add(counter.size);
+    jsonSize.add(counter.escaped);
   }
 
-  reply[len++] = (uint8_t)V2MIDI::Packet::Status::SystemExclusiveEnd;
-  sendSystemExclusive(transport, len);
-}
+  // The status byte, the manufacturer ID and the end byte.
+  const uint32_t size   = _sysexSize - 3;
+  const uint32_t budget = size * system.replyBudget / 100;
+  jsonReply["budget"]   = budget;
+
+  // Measure the entire document, including the report itself; the second
+  // pass accounts for the digits of the size value.
+  JSONCounter counter;
+  for (uint8_t i = 0; i < 2; i++) {
+    counter = JSONCounter();
+    serializeJson(json, counter);
+    jsonReply["size"] = counter.escaped;
+  }
 
-// Handle a SystemExclusive, JSON request from the host.
-void V2Device::handleSystemExclusive(V2MIDI::Transport* transport, const uint8_t* buffer, uint32_t len) {
-  if (len < 24)
+  if (counter.escaped <= budget)
     return;
 
-  // 0x7d == SysEx prototype/research/private ID
-  if (buffer[1] != 0x7d)
+  jsonReply["warning"] = true;
+
+  // The reply is sent only if it leaves space in the buffer, see sendJSON().
+  if (counter.escaped < size - 1)
     return;
 
+  jsonReply["overflow"] = true;
+  for (uint8_t i = 0; i < V2Base::countof(sections); i++) {
+    if (strcmp(sections[i], "metadata") != 0 && strcmp(sections[i], "system") != 0)
+      jsonDevice.remove(sections[i]);
+  }
+}
+#endif
+
+// The common and the device-specific configuration.
+void V2Device::addConfiguration(JsonObject config) {
+  config["#usb"]     = "USB Settings";
+  JsonObject jsonUsb = config["usb"].to<JsonObject>();
+  jsonUsb["#name"]   = "Device Name";
+  jsonUsb["name"]    = _eeprom.usb.name;
+
+  jsonUsb["#vid"] = "USB Vendor ID";
+  jsonUsb["vid"]  = _eeprom.usb.vid;
+
+  jsonUsb["#pid"] = "USB Product ID";
+  jsonUsb["pid"]  = _eeprom.usb.pid;
+
+  if (usb.ports.standard > 0) {
+    jsonUsb["#ports"] = "Number of MIDI ports";
+    jsonUsb["ports"]  = _eeprom.usb.ports;
+  }
+
+  exportConfiguration(config);
+}
+
+void V2Device::importUSB(JsonObject jsonUsb) {
+  const char* n = jsonUsb["name"];
+  if (n) {
+    if (strlen(n) > 1 && strlen(n) < 32) {
+      strcpy(_eeprom.usb.name, n);
+      usb.name = _eeprom.usb.name;
+
+    } else {
+      usb.name = NULL;
+      memset(_eeprom.usb.name, 0, sizeof(_eeprom.usb.name));
+    }
+  }
+
+  if (!jsonUsb["vid"].isNull()) {
+    uint16_t vid    = jsonUsb["vid"];
+    _eeprom.usb.vid = vid;
+  }
+
+  if (!jsonUsb["pid"].isNull()) {
+    uint16_t pid    = jsonUsb["pid"];
+    _eeprom.usb.pid = pid;
+  }
+
+  if (!jsonUsb["ports"].isNull()) {
+    uint8_t p = jsonUsb["ports"];
+    if (p <= 16)
+      _eeprom.usb.ports = p;
+  }
+}
+
+// Copy the members of 'from' which are named in 'keys', recursively.
+static void copyMembers(JsonObject to, JsonObject from, JsonObject keys) {
+  for (JsonPair key : keys) {
+    JsonVariant value = from[key.key()];
+    if (value.isNull())
+      continue;
+
+    JsonObject object = key.value();
+    if (object && value.is<JsonObject>())
+      copyMembers(to[key.key()].to<JsonObject>(), value, object);
+    else
+      to[key.key()] = value;
+  }
+}
+
+// A short reply to a state change. The configuration contains only the members
+// named in 'keys', with their current values.
+void V2Device::sendStatus(V2MIDI::Transport* transport, JsonObject keys) {
+  JsonDocument reply(&jsonAllocator);
+  JsonObject   jsonReply = reply["com.versioduo.device"].to<JsonObject>();
+  jsonReply["token"]     = _boot.id;
+  jsonReply["status"]    = "success";
+  jsonReply["sequence"]  = _state.sequence;
+
+  if (keys) {
+    JsonDocument current(&jsonAllocator);
+    addConfiguration(current.to<JsonObject>());
+    copyMembers(jsonReply["configuration"].to<JsonObject>(), current.as<JsonObject>(), keys);
+  }
+
+  sendJSON(transport, reply);
+}
+
+// Send a JSON document as a SystemExclusive message, escape unicode characters.
+void V2Device::sendJSON(V2MIDI::Transport* transport, const JsonDocument& json) {
+  uint8_t* reply = getSystemExclusiveBuffer();
+  uint32_t len   = 0;
+
+  // 0x7d == SysEx research/private ID
+  reply[len++] = (uint8_t)V2MIDI::Packet::Status::SystemExclusive;
+  reply[len++] = 0x7d;
+
+  // Most replies are plain ASCII; serialize directly into the reply buffer and
+  // escape unicode characters only if there are any.
+  const uint32_t size    = _sysexSize - len - 1;
+  const uint32_t jsonLen = serializeJson(json, (char*)reply + len, size);
+
+  bool ascii = true;
+  for (uint32_t i = 0; i < jsonLen; i++) {
+    if (reply[len + i] > 0x7f) {
+      ascii = false;
+      break;
+    }
+  }
+
+  // 8-bit messages carry UTF-8 unescaped.
+  if (ascii || transport == _sysex8) {
+    // A full buffer might be a truncated document.
+    if (jsonLen < size - 1)
+      len += jsonLen;
+
+  } else {
+#if V2DEVICE_UNICODE
+    uint8_t        jsonBuffer[_sysexSize];
+    const uint32_t bufferLen = serializeJson(json, (char*)jsonBuffer, _sysexSize);
+    len += escapeJSON(jsonBuffer, bufferLen, reply + len, size);
+#else
+    // Replace every UTF-8 sequence with a single character, in place.
+    uint32_t replyLen = 0;
+    for (uint32_t i = 0; i < jsonLen; i++) {
+      const uint8_t c = reply[len + i];
+      if (c >= 0x80 && c < 0xc0)
+        continue;
+
+      reply[len + replyLen++] = c < 0x80 ? c : '?';
+    }
+
+    if (jsonLen < size - 1)
+      len += replyLen;
+#endif
+  }
+
+  reply[len++] = (uint8_t)V2MIDI::Packet::Status::SystemExclusiveEnd;
+  sendRequestReply(transport, len);
+}
+
+#if V2DEVICE_LINK
+// Ask all children for their current state; the replies are collected and
+// sent as a single message.
+void V2Device::requestChildren(V2MIDI::Transport* transport) {
+  if (_children.json)
+    return;
+
+  _children.transport = transport;
+  _children.usec      = V2Base::getUsec();
+  _children.json      = new JsonDocument(&jsonAllocator);
+
+  JsonObject jsonDevice = (*_children.json)["com.versioduo.device"].to<JsonObject>();
+  jsonDevice["token"]   = _boot.id;
+  jsonDevice["children"].to<JsonObject>();
+
+  if (link && link->socket) {
+    const char request[] = "{\"com.versioduo.device\":{\"method\":\"getAll\"}}";
+    uint8_t    buffer[sizeof(request) + 2];
+    buffer[0] = (uint8_t)V2MIDI::Packet::Status::SystemExclusive;
+    buffer[1] = 0x7d;
+    memcpy(buffer + 2, request, sizeof(request) - 1);
+    buffer[sizeof(buffer) - 1] = (uint8_t)V2MIDI::Packet::Status::SystemExclusiveEnd;
+
+    // Port 0 is the device itself. A failed send is not counted as dropped;
+    // most ports have no child connected.
+    const uint8_t ports = usb.ports.access > 0 ? usb.ports.access : 16;
+    for (uint8_t i = 1; i < ports; i++) {
+      if (sendToChild(i, buffer, sizeof(buffer)))
+        _children.pending |= 1 << i;
+    }
+  }
+}
+
+bool V2Device::dispatchChild(uint8_t position, const uint8_t* buffer, uint32_t len) {
+  if (position > 15)
+    return false;
+
+  if (len < 24 || buffer[1] != 0x7d || buffer[2] != '{')
+    return false;
+
+#if V2DEVICE_FIRMWARE
+  // The acknowledgement of a forwarded firmware packet.
+  if (_relay.pending & (1 << position)) {
+    JsonDocument json(&jsonAllocator);
+    if (deserializeJson(json, buffer + 2, len - 1))
+      return false;
+
+    const char* status = json["com.versioduo.device"]["firmware"]["status"];
+    if (!status)
+      return false;
+
+    if (strcmp(status, "success") == 0) {
+      _relay.status[position] = "success";
+
+    } else {
+      if (strcmp(status, "hashMismatch") == 0)
+        _relay.status[position] = "hashMismatch";
+      else if (strcmp(status, "invalidOffset") == 0)
+        _relay.status[position] = "invalidOffset";
+      else
+        _relay.status[position] = "failed";
+
+      _relay.children &= ~(1 << position);
+    }
+
+    _relay.pending &= ~(1 << position);
+    if (_relay.pending == 0)
+      sendRelayStatus();
+
+    return true;
+  }
+#endif
+
+  if (!_children.json || !(_children.pending & (1 << position)))
+    return false;
+
+  // Keep only the identity and the statistics of the child, the entire
+  // getAll replies of all children do not fit into a single message.
+  JsonDocument filter(&jsonAllocator);
+  {
+    JsonObject jsonDevice                        = filter["com.versioduo.device"].to<JsonObject>();
+    jsonDevice["metadata"]["product"]            = true;
+    jsonDevice["metadata"]["serial"]             = true;
+    jsonDevice["metadata"]["version"]            = true;
+    jsonDevice["system"]["name"]                 = true;
+    jsonDevice["system"]["boot"]                 = true;
+    jsonDevice["system"]["firmware"]["id"]       = true;
+    jsonDevice["system"]["firmware"]["board"]    = true;
+    jsonDevice["system"]["firmware"]["hash"]     = true;
+    jsonDevice["system"]["hardware"]["board"]    = true;
+    jsonDevice["system"]["hardware"]["revision"] = true;
+    jsonDevice["system"]["midi"]                 = true;
+    jsonDevice["system"]["link"]                 = true;
+    jsonDevice["system"]["serial"]               = true;
+  }
+
+  JsonDocument json(&jsonAllocator);
+  if (deserializeJson(json, buffer + 2, len - 1, DeserializationOption::Filter(filter)))
+    return false;
+
+  JsonObject jsonChild = json["com.versioduo.device"];
+  if (!jsonChild)
+    return false;
+
+  char key[4];
+  sprintf(key, "%d", position);
+  (*_children.json)["com.versioduo.device"]["children"][key] = jsonChild;
+
+  _children.pending &= ~(1 << position);
+  if (_children.pending == 0)
+    sendChildren();
+
+  return true;
+}
+
+void V2Device::sendChildren() {
+#if V2DEVICE_FIRMWARE
+  if (_relay.select) {
+    // Select the children with a matching firmware, remember their tokens.
+    _relay.select   = false;
+    _relay.children = 0;
+
+    JsonObject  jsonChildren = (*_children.json)["com.versioduo.device"]["children"];
+    const char* id           = (*_children.json)["relay"]["id"];
+    const char* board        = (*_children.json)["relay"]["board"];
+    for (JsonPair child : jsonChildren) {
+      JsonObject jsonSystem = child.value()["system"];
+      if (jsonSystem["firmware"]["id"] != id)
+        continue;
+
+      if (board && jsonSystem["firmware"]["board"] != board)
+        continue;
+
+      const uint8_t position  = atoi(child.key().c_str());
+      _relay.children        |= 1 << position;
+      _relay.tokens[position] = jsonSystem["boot"]["id"];
+    }
+
+    JsonDocument json(&jsonAllocator);
+    JsonObject   jsonDevice = json["com.versioduo.device"].to<JsonObject>();
+    jsonDevice["token"]     = _boot.id;
+    JsonObject jsonFirmware = jsonDevice["firmware"].to<JsonObject>();
+    jsonFirmware["status"]  = _relay.children > 0 ? "success" : "noChildren";
+    JsonArray jsonSelected  = jsonFirmware["children"].to<JsonArray>();
+    for (uint8_t i = 1; i < 16; i++) {
+      if (_relay.children & (1 << i))
+        jsonSelected.add(i);
+    }
+
+    sendJSON(_children.transport, json);
+
+  } else
+#endif
+    sendJSON(_children.transport, *_children.json);
+
+  delete _children.json;
+  _children.json    = NULL;
+  _children.pending = 0;
+}
+#endif
+
+// Check the structure of the request before it is parsed; the cost of parsing
+// is bounded by the limits. The length of "data" values is not checked.
+bool V2Device::checkRequest(const uint8_t* text, uint32_t len) {
+  const char* end     = (const char*)text + len;
+  uint8_t     depth   = 0;
+  uint32_t    members = 0;
+  bool        string  = false;
+  uint32_t    start   = 0;
+  bool        data    = false;
+
+  for (uint32_t i = 0; i < len; i++) {
+    const uint8_t c = text[i];
+
+    if (string) {
+      if (c == '\\') {
+        i++;
+        continue;
+      }
+
+      if (c != '"')
+        continue;
+
+      string = false;
+      if (i - start > limits.string && !data) {
+        _requests.rejected.string++;
+        return false;
+      }
+
+      // The name of a "data" member; its value is not checked.
+      const char* next = skipWhitespace((const char*)text + i + 1, end);
+      data = next < end && *next == ':' && i - start == 4 && memcmp(text + start, "data", 4) == 0;
+      continue;
+    }
+
+    switch (c) {
+      case '"':
+        string = true;
+        start  = i + 1;
+        break;
+
+      case '{':
+      case '[': {
+        if (++depth > limits.nesting) {
+          _requests.rejected.nesting++;
+          return false;
+        }
+
+        // The first member or element of a non-empty object or array.
+        const char* next = skipWhitespace((const char*)text + i + 1, end);
+        if (next < end && *next != '}' && *next != ']' && ++members > limits.members) {
+          _requests.rejected.members++;
+          return false;
+        }
+        break;
+      }
+
+      case '}':
+      case ']':
+        depth--;
+        break;
+
+      // The following members and elements.
+      case ',':
+        if (++members > limits.members) {
+          _requests.rejected.members++;
+          return false;
+        }
+        break;
+    }
+  }
+
+  return true;
+}
+
+// Take a token from the bucket, after adding the tokens for the time since the
+// previous request.
+static bool takeToken(uint32_t* usec, uint32_t* tokens, uint16_t rate, uint8_t burst) {
+  if (rate == 0)
+    return true;
+
+  const uint32_t now  = V2Base::getUsec();
+  const uint32_t full = burst * 1000 * 1000;
+  if (*usec == 0)
+    *tokens = full;
+
+  else {
+    const uint64_t added = (uint64_t)*tokens + (uint64_t)(now - *usec) * rate;
+    *tokens              = added > full ? full : added;
+  }
+
+  *usec = now;
+  if (*tokens < 1000 * 1000)
+    return false;
+
+  *tokens -= 1000 * 1000;
+  return true;
+}
+
+// Protect the device from hosts which send requests faster than they can be
+// handled; e.g. "getAll" in a tight loop would starve handleLoop().
+bool V2Device::admitRequest(V2MIDI::Transport* transport, const char* method) {
+  Bucket*   bucket  = &_buckets.other;
+  uint32_t* dropped = &_requests.dropped.other;
+  if (transport == &usb.midi) {
+    bucket  = &_buckets.usb;
+    dropped = &_requests.dropped.usb;
+  }
+#if V2DEVICE_SERIAL
+  else if (serial && transport == serial) {
+    bucket  = &_buckets.serial;
+    dropped = &_requests.dropped.serial;
+  }
+#endif
+
+  const RequestRate* rate  = &limits.transport;
+  bool               admit = takeToken(&bucket->usec, &bucket->tokens, rate->rate, rate->burst);
+  if (admit && method) {
+    for (uint8_t i = 0; i < V2Base::countof(limits.methods); i++) {
+      if (!limits.methods[i].method || strcmp(limits.methods[i].method, method) != 0)
+        continue;
+
+      bucket  = &_buckets.methods[i];
+      dropped = &_requests.dropped.methods[i];
+      rate    = &limits.methods[i].rate;
+      admit   = takeToken(&bucket->usec, &bucket->tokens, rate->rate, rate->burst);
+      break;
+    }
+  }
+
+  if (admit) {
+    bucket->busy = 0;
+    return true;
+  }
+
+  (*dropped)++;
+
+  // A host which retries too early is told again after the time of a token;
+  // a silent drop would look like a lost message.
+  const uint32_t usec = V2Base::getUsec();
+  if (bucket->busy > 0 && (uint32_t)(usec - bucket->busy) < 1000 * 1000 / rate->rate)
+    return false;
+
+  // The reply buffer holds a single message. A previous reply which is still
+  // being sent is not replaced; the host is told with its next request.
+  if (transport != _sysex8 && loopSystemExclusive() > 0)
+    return false;
+
+  bucket->busy = usec | 1;
+
+  JsonDocument json(&jsonAllocator);
+  JsonObject   jsonDevice = json["com.versioduo.device"].to<JsonObject>();
+  jsonDevice["token"]     = _boot.id;
+  jsonDevice["status"]    = "busy";
+  sendJSON(transport, json);
+  return false;
+}
+
+// A MIDI 1.0 SystemExclusive message; the JSON text is framed by 0xf0 0x7d and 0xf7.
+void V2Device::handleSystemExclusive(V2MIDI::Transport* transport, const uint8_t* buffer, uint32_t len) {
+  if (len < 24)
+    return;
+
+  // 0x7d == SysEx prototype/research/private ID
+  if (buffer[1] != 0x7d)
+    return;
+
+  // The transport has switched back to 7-bit messages.
+  if (transport == _sysex8)
+    _sysex8 = NULL;
+
+  // The base64 data of firmware and region packets is decoded directly from the
+  // message buffer; it is not copied into the JSON document.
+  uint32_t    dataLen;
+  const char* data = findData(buffer, len, &dataLen);
+
+  handleMessage(transport, buffer + 2, len - 3, data, dataLen, false);
+}
+
+void V2Device::dispatchSystemExclusive8(V2MIDI::Transport* transport, const uint8_t* buffer, uint32_t len) {
+  if (len < 2 || buffer[0] != 0x7d)
+    return;
+
+  _sysex8 = transport;
+
+  // The raw data follows the JSON text.
+  const uint8_t* end     = (const uint8_t*)memchr(buffer + 1, '\0', len - 1);
+  const uint32_t textLen = end ? end - (buffer + 1) : len - 1;
+  const char*    data    = end ? (const char*)end + 1 : NULL;
+  const uint32_t dataLen = end ? buffer + len - (end + 1) : 0;
+
+  handleMessage(transport, buffer + 1, textLen, data, dataLen, true);
+}
+
+// Handle the JSON text of a message, record the peak memory usage of the request.
+void V2Device::handleMessage(V2MIDI::Transport* transport,
+                             const uint8_t*     text,
+                             uint32_t           textLen,
+                             const char*        data,
+                             uint32_t           dataLen,
+                             bool               raw) {
+#if !V2DEVICE_STATISTICS
+  handleRequest(transport, text, textLen, data, dataLen, raw);
+#else
+  jsonAllocator.peak = jsonAllocator.used;
+  _ram.method[0]     = '\0';
+  _latency.active    = true;
+
+  handleRequest(transport, text, textLen, data, dataLen, raw);
+  _latency.active = false;
+
+  if (_ram.method[0] == '\0')
+    return;
+
+  // The stack is measured only on the device; a host build of the library
+  // records the heap.
+  uint32_t stack = 0;
+#if defined(__arm__)
+  if (stackPainted)
+    stack = measureStack();
+#endif
+
+  if (stack > _ram.stack)
+    _ram.stack = stack;
+
+  if (jsonAllocator.peak > _ram.heap)
+    _ram.heap = jsonAllocator.peak;
+
+  for (uint8_t i = 0; i < V2Base::countof(_ram.methods); i++) {
+    auto* method = &_ram.methods[i];
+    if (method->name[0] == '\0')
+      strlcpy(method->name, _ram.method, sizeof(method->name));
+
+    else if (strcmp(method->name, _ram.method) != 0)
+      continue;
+
+    if (stack > method->stack)
+      method->stack = stack;
+
+    if (jsonAllocator.peak > method->heap)
+      method->heap = jsonAllocator.peak;
+
+    break;
+  }
+#endif
+}
+
+// Handle a JSON request from the host. The data of a firmware or region packet
+// is base64 encoded, or raw data of an 8-bit message.
+void V2Device::handleRequest(V2MIDI::Transport* transport,
+                             const uint8_t*     text,
+                             uint32_t           textLen,
+                             const char*        data,
+                             uint32_t           dataLen,
+                             bool               raw) {
+  _latency.usec = V2Base::getUsec();
+
   // Handle only JSON messages.
-  if (buffer[2] != '{' || buffer[len - 2] != '}')
+  if (textLen < 21 || text[0] != '{' || text[textLen - 1] != '}')
+    return;
+
+  if (!checkRequest(text, textLen))
     return;
 
+  JsonDocument filter(&jsonAllocator);
+  {
+    JsonObject jsonDevice          = filter["com.versioduo.device"].to<JsonObject>();
+    jsonDevice["*"]                = true;
+    jsonDevice["firmware"]["*"]    = true;
+    jsonDevice["firmware"]["data"] = false;
+    jsonDevice["region"]["*"]      = true;
+    jsonDevice["region"]["data"]   = false;
+  }
+
   // Read incoming message.
-  JsonDocument json;
-  if (deserializeJson(json, buffer + 2, len - 1))
+  JsonDocument json(&jsonAllocator);
+  if (deserializeJson(json,
+                     text,
+                     textLen,
+                     DeserializationOption::Filter(filter),
+                     DeserializationOption::NestingLimit(limits.nesting)))
     return;
 
+  filter.clear();
+
+  if ((uint32_t)(V2Base::getUsec() - _latency.usec) > limits.usec)
+    _requests.slow++;
+
   // Only handle requests for our interface.
   JsonObject jsonDevice = json["com.versioduo.device"];
   if (!jsonDevice)
@@ -573,22 +1800,80 @@ void V2Device::handleSystemExclusive(V2MIDI::Transport* transport, const uint8_t
   if (!jsonDevice["token"].isNull() && jsonDevice["token"] != _boot.id)
     return;
 
+  if (!admitRequest(transport, jsonDevice["method"]))
+    return;
+
+#if V2DEVICE_STATISTICS
+  // Every handled method returns; the name is reset at the end of the
+  // function, unknown methods do not take a slot of the table.
+  const char* method = jsonDevice["method"];
+  if (method)
+    strlcpy(_ram.method, method, sizeof(_ram.method));
+#endif
+
   if (jsonDevice["method"] == "getAll") {
+    const bool report = jsonDevice["report"] == true;
     json.clear();
-    sendReply(transport);
+    sendReply(transport, report);
     return;
   }
 
+  if (jsonDevice["method"] == "ping") {
+    sendPing(transport, jsonDevice["nonce"]);
+    return;
+  }
+
+#if V2DEVICE_LINK
+  if (jsonDevice["method"] == "getChildren") {
+    json.clear();
+    requestChildren(transport);
+    if (_children.json && _children.pending == 0)
+      sendChildren();
+
+    return;
+  }
+#endif
+
+#if V2DEVICE_FIRMWARE && V2DEVICE_LINK
+  // Update the firmware of the children. The first message carries the id of
+  // the firmware image, the following ones the writeFirmware packets.
+  if (jsonDevice["method"] == "relayFirmware") {
+    JsonObject firmware = jsonDevice["firmware"];
+    if (!firmware)
+      return;
+
+    if (!data) {
+      selectRelayChildren(transport, firmware["id"], firmware["board"]);
+      return;
+    }
+
+    relayFirmware(transport, json, data, dataLen, raw);
+    return;
+  }
+#endif
+
   if (jsonDevice["method"] == "eraseConfiguration") {
     // Wipe the entire EEPROM area.
     V2Base::Memory::EEPROM::erase();
+    if (storage)
+      storage->erase();
+
     V2Base::Memory::Firmware::reboot();
     return;
   }
 
   if (jsonDevice["method"] == "switchChannel") {
-    if (!jsonDevice["channel"].isNull())
+    if (!jsonDevice["channel"].isNull()) {
       handleSwitchChannel(jsonDevice["channel"]);
+      _state.sequence++;
+    }
+
+    if (jsonDevice["reply"] == "minimal") {
+      json.clear();
+      sendStatus(transport, JsonObject());
+      return;
+    }
+
     json.clear();
     sendReply(transport);
     return;
@@ -605,6 +1890,15 @@ void V2Device::handleSystemExclusive(V2MIDI::Transport* transport, const uint8_t
     return;
   }
 
+  // Switch the number of ports without a reboot; the application keeps running
+  // while the USB device is disconnected and enumerated again.
+  if (jsonDevice["method"] == "reconnect" || jsonDevice["method"] == "reconnectWithPorts") {
+    usb.ports.enableAccess = jsonDevice["method"] == "reconnectWithPorts";
+    usb.midi.detach();
+    _reconnect.usec = V2Base::getUsec();
+    return;
+  }
+
   // Write the configuration the the EEPROM.
   if (jsonDevice["method"] == "writeConfiguration") {
     // The data in enclosed in an object to prevent name clashes with the
@@ -612,41 +1906,22 @@ void V2Device::handleSystemExclusive(V2MIDI::Transport* transport, const uint8_t
     JsonObject config = jsonDevice["configuration"];
     if (config) {
       JsonObject jsonUsb = config["usb"];
-      if (jsonUsb) {
-        const char* n = jsonUsb["name"];
-        if (n) {
-          if (strlen(n) > 1 && strlen(n) < 32) {
-            usb.name = n;
-            strcpy(_eeprom.usb.name, n);
-
-          } else {
-            usb.name = NULL;
-            memset(_eeprom.usb.name, 0, sizeof(_eeprom.usb.name));
-          }
-        }
-
-        if (!jsonUsb["vid"].isNull()) {
-          uint16_t vid    = jsonUsb["vid"];
-          _eeprom.usb.vid = vid;
-        }
-
-        if (!jsonUsb["pid"].isNull()) {
-          uint16_t pid    = jsonUsb["pid"];
-          _eeprom.usb.pid = pid;
-        }
-
-        if (!jsonUsb["ports"].isNull()) {
-          uint8_t p = jsonUsb["ports"];
-          if (p <= 16)
-            _eeprom.usb.ports = p;
-        }
-      }
+      if (jsonUsb)
+        importUSB(jsonUsb);
 
       // Device-specific section.
       if (configuration.size > 0)
         importConfiguration(config);
 
       writeConfiguration();
+      _state.sequence++;
+    }
+
+    // Reply only with the written part of the configuration.
+    if (jsonDevice["reply"] == "minimal") {
+      sendStatus(transport, config);
+      json.clear();
+      return;
     }
 
     // Reply with the updated configuration.
@@ -655,6 +1930,101 @@ void V2Device::handleSystemExclusive(V2MIDI::Transport* transport, const uint8_t
     return;
   }
 
+  // Change only the fields present in the configuration object. Members with a
+  // null value are reset to their default, if the device supports that. The reply
+  // carries only the patched fields.
+  if (jsonDevice["method"] == "patchConfiguration") {
+    JsonObject config = jsonDevice["configuration"];
+    if (!config)
+      return;
+
+    JsonObject jsonUsb = config["usb"];
+    if (jsonUsb) {
+      importUSB(jsonUsb);
+
+      for (JsonPair member : jsonUsb) {
+        if (!member.value().isNull())
+          continue;
+
+        if (member.key() == "name") {
+          usb.name = NULL;
+          memset(_eeprom.usb.name, 0, sizeof(_eeprom.usb.name));
+
+        } else if (member.key() == "vid")
+          _eeprom.usb.vid = 0;
+
+        else if (member.key() == "pid")
+          _eeprom.usb.pid = 0;
+
+        else if (member.key() == "ports")
+          _eeprom.usb.ports = 0;
+      }
+    }
+
+    if (configuration.size > 0)
+      importConfiguration(config);
+
+    writeConfiguration();
+    _state.sequence++;
+
+    sendStatus(transport, config);
+    json.clear();
+    return;
+  }
+
+  if (jsonDevice["method"] == "storePreset" || jsonDevice["method"] == "recallPreset") {
+    const uint8_t preset  = jsonDevice["preset"];
+    const bool    success = jsonDevice["method"] == "storePreset" ? storePreset(preset) : recallPreset(preset);
+    json.clear();
+
+    if (!success) {
+      JsonDocument reply(&jsonAllocator);
+      JsonObject   jsonReply = reply["com.versioduo.device"].to<JsonObject>();
+      jsonReply["token"]     = _boot.id;
+      jsonReply["status"]    = "invalidPreset";
+      sendJSON(transport, reply);
+      return;
+    }
+
+    sendStatus(transport, JsonObject());
+    return;
+  }
+
+  if (jsonDevice["method"] == "readConfigurationBinary") {
+    json.clear();
+    readConfigurationBinary(transport);
+    return;
+  }
+
+  if (jsonDevice["method"] == "writeConfigurationBinary") {
+    writeConfigurationBinary(transport, jsonDevice["binary"]);
+    return;
+  }
+
+  if (jsonDevice["method"] == "writeRegion") {
+    writeRegion(transport, jsonDevice["region"], data, dataLen, raw);
+    return;
+  }
+
+#if V2DEVICE_FIRMWARE
+  // The offset to continue an interrupted upload of the image with the given hash.
+  if (jsonDevice["method"] == "getFirmwareProgress") {
+    const char* image  = jsonDevice["firmware"]["image"];
+    const bool  resume = image && strcmp(image, bootData.firmware.hash) == 0;
+    json.clear();
+
+    JsonDocument reply(&jsonAllocator);
+    JsonObject   jsonReply  = reply["com.versioduo.device"].to<JsonObject>();
+    jsonReply["token"]      = _boot.id;
+    JsonObject jsonFirmware = jsonReply["firmware"].to<JsonObject>();
+    if (resume)
+      jsonFirmware["image"] = bootData.firmware.hash;
+    jsonFirmware["offset"] = resume ? bootData.firmware.offset : 0;
+
+    sendJSON(transport, reply);
+    return;
+  }
+
   if (jsonDevice["method"] == "writeFirmware") {
     // The data in enclosed in an object to prevent name clashes with the
     // calling convention.
@@ -666,37 +2036,59 @@ void V2Device::handleSystemExclusive(V2MIDI::Transport* transport, const uint8_t
         return;
       }
 
-      const char* data = firmware["data"];
       union {
         uint32_t block[V2Base::Memory::Flash::getBlockSize() / sizeof(uint32_t)];
         uint8_t  bytes[V2Base::Memory::Flash::getBlockSize()];
       };
-      uint32_t blockLen = V2Base::Text::Base64::decode((const uint8_t*)data, bytes);
+      uint32_t blockLen;
+      if (!decodeBlock(data, dataLen, raw, block, &blockLen)) {
+        sendFirmwareStatus(transport, "invalidData");
+        return;
+      }
+
+      // The upload of a different image starts over. A packet without an
+      // image hash overwrites the secondary area; a previously recorded
+      // upload can no longer be continued.
+      const char* image = firmware["image"];
+      if (!image)
+        memset(&bootData.firmware, 0, sizeof(bootData.firmware));
+
+      else if (strcmp(image, bootData.firmware.hash) != 0) {
+        strlcpy(bootData.firmware.hash, image, sizeof(bootData.firmware.hash));
+        bootData.firmware.offset = 0;
+      }
 
       memset(bytes + blockLen, 0xff, V2Base::Memory::Flash::getBlockSize() - blockLen);
+
+      // The final message contains our hash over the entire image.
+      const char* hash = firmware["hash"];
+
+      // Request the next packet before the block is erased and written; the
+      // transfer of the next packet overlaps with the flash operation. The reply
+      // is queued in the port's buffer, it needs to be sent before the write
+      // blocks. A failed write will be caught by the hash verification of the
+      // final packet.
+      if (!hash) {
+        sendFirmwareStatus(transport, "success");
+        flushReply();
+      }
+
       led.setBrightness(0.3);
       V2Base::Memory::Firmware::Secondary::writeBlock(offset, block);
       led.setBrightness(0.1);
 
-      // The final message contains our hash over the entire image.
-      const char* hash = firmware["hash"];
+      if (image && offset == bootData.firmware.offset)
+        bootData.firmware.offset = offset + blockLen;
+
       if (hash) {
         V2Base::Memory::Firmware::Secondary::copyBootloader();
 
         if (V2Base::Memory::Firmware::Secondary::verify(offset + blockLen, hash)) {
+          memset(&bootData.firmware, 0, sizeof(bootData.firmware));
           sendFirmwareStatus(transport, "success");
 
           // Flush system exclusive message, loop() is no longer called.
-          uint32_t usec = V2Base::getUsec();
-          for (;;) {
-            if (loopSystemExclusive() == 0)
-              break;
-
-            if ((uint32_t)(V2Base::getUsec() - usec) > 100 * 1000)
-              break;
-
-            yield();
-          }
+          flushReply();
 
           // Give the host time to process the message before the USB device disconnects.
           led.setBrightness(1);
@@ -706,15 +2098,152 @@ void V2Device::handleSystemExclusive(V2MIDI::Transport* transport, const uint8_t
           V2Base::Memory::Firmware::Secondary::activate();
         }
 
+        bootData.firmware.offset = 0;
         sendFirmwareStatus(transport, "hashMismatch");
-
-      } else {
-        sendFirmwareStatus(transport, "success");
       }
     }
 
     return;
   }
+#endif
+
+#if V2DEVICE_STATISTICS
+  _ram.method[0] = '\0';
+#endif
+}
+
+#if V2DEVICE_FIRMWARE && V2DEVICE_LINK
+// Find the children to update; the selection is completed in sendChildren().
+void V2Device::selectRelayChildren(V2MIDI::Transport* transport, const char* id, const char* board) {
+  if (_children.json || _relay.pending || !id)
+    return;
+
+  requestChildren(transport);
+  _relay.select = true;
+
+  // The strings of the request are freed before the children reply; they
+  // are copied, a const char* is stored by pointer by ArduinoJson before 7.3.
+  (*_children.json)["relay"]["id"] = (char*)id;
+  if (board)
+    (*_children.json)["relay"]["board"] = (char*)board;
+
+  if (_children.pending == 0)
+    sendChildren();
+}
+
+static uint32_t encodeBase64(const uint8_t* data, uint32_t size, char* text);
+
+// Forward the firmware packet to all selected children. The packet is sent to all
+// of them at once, the host's next packet is requested when all children have
+// written the block. The children verify the hash of the image themselves.
+void V2Device::relayFirmware(V2MIDI::Transport* transport,
+                             JsonDocument&      json,
+                             const char*        data,
+                             uint32_t           dataLen,
+                             bool               raw) {
+  if (_relay.pending)
+    return;
+
+  if (_relay.children == 0) {
+    sendFirmwareStatus(transport, "noChildren");
+    return;
+  }
+
+  if (raw && (!data || dataLen > V2Base::Memory::Flash::getBlockSize())) {
+    sendFirmwareStatus(transport, "invalidData");
+    return;
+  }
+
+  // The packets are built in the SystemExclusive buffer, the reply to the host
+  // is sent after the children have acknowledged the packet. The host's
+  // previous reply needs to have left the buffer.
+  flushReply();
+  if (loopSystemExclusive() > 0) {
+    sendFirmwareStatus(transport, "busy");
+    return;
+  }
+
+  _relay.transport = transport;
+  _relay.usec      = V2Base::getUsec();
+
+  uint8_t* buffer = getSystemExclusiveBuffer();
+
+  // Rewrite the request for the children, all values are plain ASCII. The link
+  // carries 7-bit messages, raw data is encoded in the buffer and copied.
+  JsonObject jsonDevice = json["com.versioduo.device"];
+  jsonDevice["method"]  = "writeFirmware";
+  if (raw) {
+    encodeBase64((const uint8_t*)data, dataLen, (char*)buffer);
+    jsonDevice["firmware"]["data"] = (char*)buffer;
+
+  } else
+    jsonDevice["firmware"]["data"] = serialized(data - 1, dataLen + 2);
+
+  buffer[0] = (uint8_t)V2MIDI::Packet::Status::SystemExclusive;
+  buffer[1] = 0x7d;
+
+  for (uint8_t i = 1; i < 16; i++) {
+    if (!(_relay.children & (1 << i)))
+      continue;
+
+    jsonDevice["token"] = _relay.tokens[i];
+    uint32_t len        = 2 + serializeJson(json, (char*)buffer + 2, _sysexSize - 3);
+    buffer[len++]       = (uint8_t)V2MIDI::Packet::Status::SystemExclusiveEnd;
+
+    if (sendToChild(i, buffer, len)) {
+      _relay.pending |= 1 << i;
+
+    } else {
+      _relay.status[i] = "failed";
+      _relay.children &= ~(1 << i);
+      countDropped(link->socket);
+    }
+  }
+
+  if (_relay.pending == 0)
+    sendRelayStatus();
+}
+
+// Reply to the host with the status of all children which received the packet.
+void V2Device::sendRelayStatus() {
+  JsonDocument json(&jsonAllocator);
+  JsonObject   jsonDevice = json["com.versioduo.device"].to<JsonObject>();
+  jsonDevice["token"]     = _boot.id;
+  JsonObject jsonFirmware = jsonDevice["firmware"].to<JsonObject>();
+  jsonFirmware["status"]  = _relay.children > 0 ? "success" : "noChildren";
+
+  JsonObject jsonChildren = jsonFirmware["children"].to<JsonObject>();
+  for (uint8_t i = 1; i < 16; i++) {
+    if (!_relay.status[i])
+      continue;
+
+    char key[4];
+    sprintf(key, "%d", i);
+    jsonChildren[key] = _relay.status[i];
+    _relay.status[i]  = NULL;
+  }
+
+  sendJSON(_relay.transport, json);
+}
+#endif
+
+// Write only the bytes which differ from the current EEPROM content.
+static void writeEEPROM(uint32_t offset, const uint8_t* data, uint32_t size) {
+  const uint8_t* eeprom = (const uint8_t*)V2Base::Memory::EEPROM::getStart() + offset;
+
+  for (uint32_t i = 0; i < size;) {
+    if (data[i] == eeprom[i]) {
+      i++;
+      continue;
+    }
+
+    uint32_t end = i + 1;
+    while (end < size && data[end] != eeprom[end])
+      end++;
+
+    V2Base::Memory::EEPROM::write(offset + i, data + i, end - i);
+    i = end;
+  }
 }
 
 void V2Device::writeConfiguration() {
@@ -722,11 +2251,334 @@ void V2Device::writeConfiguration() {
   _eeprom.local.magic   = usb.pid;
   _eeprom.local.version = configuration.version;
   _eeprom.local.size    = configuration.size;
-  V2Base::Memory::EEPROM::write(0, (const uint8_t*)&_eeprom, sizeof(_eeprom));
+  writeEEPROM(0, (const uint8_t*)&_eeprom, sizeof(_eeprom));
 
   // Device-specific section.
   if (configuration.size > 0)
-    V2Base::Memory::EEPROM::write(sizeof(_eeprom), (const uint8_t*)configuration.data, configuration.size);
+    writeEEPROM(sizeof(_eeprom), (const uint8_t*)configuration.data, configuration.size);
+
+  if (storage)
+    storage->flush();
+}
+
+// Make the block at the offset the one in RAM; write back the previous one.
+void V2Device::Storage::load(uint32_t offset) {
+  const uint32_t blockSize = V2Base::Memory::Flash::getBlockSize();
+  offset -= offset % blockSize;
+
+  if (_block.data && _block.offset == offset)
+    return;
+
+  flush();
+
+  if (!_block.data)
+    _block.data = new uint32_t[blockSize / sizeof(uint32_t)];
+
+  memcpy(_block.data, (const void*)(_start + offset), blockSize);
+  _block.offset = offset;
+}
+
+bool V2Device::Storage::read(uint32_t offset, void* data, uint32_t size) {
+  if (offset + size > _size)
+    return false;
+
+  const uint32_t blockSize = V2Base::Memory::Flash::getBlockSize();
+  uint8_t*       bytes     = (uint8_t*)data;
+
+  while (size > 0) {
+    const uint32_t block = offset - offset % blockSize;
+    const uint32_t len   = min(size, block + blockSize - offset);
+
+    // The modified block in RAM, or the flash.
+    if (_block.data && _block.offset == block)
+      memcpy(bytes, (const uint8_t*)_block.data + offset - block, len);
+    else
+      memcpy(bytes, (const void*)(_start + offset), len);
+
+    bytes += len;
+    offset += len;
+    size -= len;
+  }
+
+  return true;
+}
+
+bool V2Device::Storage::write(uint32_t offset, const void* data, uint32_t size) {
+  if (offset + size > _size)
+    return false;
+
+  const uint32_t blockSize = V2Base::Memory::Flash::getBlockSize();
+  const uint8_t* bytes     = (const uint8_t*)data;
+
+  while (size > 0) {
+    const uint32_t block = offset - offset % blockSize;
+    const uint32_t len   = min(size, block + blockSize - offset);
+
+    // Skip unchanged data, it does not need to be written to the flash.
+    if (memcmp((const void*)(_start + offset), bytes, len) != 0 || (_block.data && _block.offset == block)) {
+      load(block);
+      memcpy((uint8_t*)_block.data + offset - block, bytes, len);
+      _block.dirty = true;
+    }
+
+    bytes += len;
+    offset += len;
+    size -= len;
+  }
+
+  return true;
+}
+
+bool V2Device::Storage::decode(uint32_t offset, const char* data, uint32_t dataLen, bool raw, uint32_t* len) {
+  const uint32_t blockSize = V2Base::Memory::Flash::getBlockSize();
+  if (offset % blockSize != 0 || offset >= _size)
+    return false;
+
+  load(offset);
+
+  // A failed decode leaves a partially written block; read it again.
+  if (!decodeBlock(data, dataLen, raw, _block.data, len) || offset + *len > _size) {
+    memcpy(_block.data, (const void*)(_start + offset), blockSize);
+    return false;
+  }
+
+  // Skip unchanged data, it does not need to be written to the flash.
+  if (memcmp((const void*)(_start + offset), _block.data, *len) != 0)
+    _block.dirty = true;
+
+  return true;
+}
+
+void V2Device::Storage::flush() {
+  if (!_block.dirty)
+    return;
+
+  V2Base::Memory::Flash::writeBlock(_start + _block.offset, _block.data);
+  _block.dirty = false;
+}
+
+void V2Device::Storage::erase() {
+  const uint32_t blockSize = V2Base::Memory::Flash::getBlockSize();
+
+  for (uint32_t offset = 0; offset < _size; offset += blockSize) {
+    load(offset);
+    memset(_block.data, 0xff, blockSize);
+    _block.dirty = true;
+  }
+
+  flush();
+}
+
+// The location of the preset slot in the EEPROM, or 0 if it does not exist.
+uint32_t V2Device::getPresetOffset(uint8_t preset) {
+  if (preset >= configuration.presets || configuration.size == 0)
+    return 0;
+
+  const uint32_t slot   = sizeof(Preset) + configuration.size;
+  const uint32_t offset = sizeof(_eeprom) + configuration.size + preset * slot;
+  if (offset + slot > V2Base::Memory::EEPROM::getSize())
+    return 0;
+
+  return offset;
+}
+
+bool V2Device::storePreset(uint8_t preset) {
+  const uint32_t offset = getPresetOffset(preset);
+  if (offset == 0)
+    return false;
+
+  Preset header;
+  header.magic   = usb.pid;
+  header.version = configuration.version;
+  header.size    = configuration.size;
+  writeEEPROM(offset, (const uint8_t*)&header, sizeof(header));
+  writeEEPROM(offset + sizeof(header), (const uint8_t*)configuration.data, configuration.size);
+  return true;
+}
+
+bool V2Device::recallPreset(uint8_t preset) {
+  const uint32_t offset = getPresetOffset(preset);
+  if (offset == 0)
+    return false;
+
+  const uint8_t* eeprom = (const uint8_t*)V2Base::Memory::EEPROM::getStart() + offset;
+  const Preset*  header = (const Preset*)eeprom;
+  if (header->magic != usb.pid || header->version != configuration.version || header->size != configuration.size)
+    return false;
+
+  memcpy(configuration.data, eeprom + sizeof(Preset), configuration.size);
+  _state.sequence++;
+  handlePreset(preset);
+  return true;
+}
+
+static uint32_t crc32(const uint8_t* data, uint32_t size) {
+  uint32_t crc = 0xffffffff;
+
+  for (uint32_t i = 0; i < size; i++) {
+    crc ^= data[i];
+    for (uint8_t k = 0; k < 8; k++)
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+
+  return ~crc;
+}
+
+static uint32_t encodeBase64(const uint8_t* data, uint32_t size, char* text) {
+  static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  uint32_t          len     = 0;
+
+  for (uint32_t i = 0; i < size; i += 3) {
+    uint32_t triple = data[i] << 16;
+    if (i + 1 < size)
+      triple |= data[i + 1] << 8;
+    if (i + 2 < size)
+      triple |= data[i + 2];
+
+    text[len++] = table[(triple >> 18) & 0x3f];
+    text[len++] = table[(triple >> 12) & 0x3f];
+    text[len++] = i + 1 < size ? table[(triple >> 6) & 0x3f] : '=';
+    text[len++] = i + 2 < size ? table[triple & 0x3f] : '=';
+  }
+
+  text[len] = '\0';
+  return len;
+}
+
+// The EEPROM image of the current configuration: the common section followed by
+// the device-specific data, in the layout written by writeConfiguration().
+void V2Device::readConfigurationBinary(V2MIDI::Transport* transport) {
+  _eeprom.local.magic   = usb.pid;
+  _eeprom.local.version = configuration.version;
+  _eeprom.local.size    = configuration.size;
+
+  const uint32_t size = sizeof(_eeprom) + configuration.size;
+
+  JsonDocument reply(&jsonAllocator);
+  JsonObject   jsonReply = reply["com.versioduo.device"].to<JsonObject>();
+  jsonReply["token"]     = _boot.id;
+
+  // The reply needs to fit into a single message. The data is encoded in the
+  // SystemExclusive buffer, the image at its end, the text at its start; the
+  // text is copied into the reply before it is sent from the same buffer.
+  const uint32_t textLen = (size + 2) / 3 * 4;
+  if (textLen + 1 + size > _sysexSize - 256) {
+    jsonReply["status"] = "tooLarge";
+    sendJSON(transport, reply);
+    return;
+  }
+
+  char*    text = (char*)getSystemExclusiveBuffer();
+  uint8_t* blob = getSystemExclusiveBuffer() + _sysexSize - size;
+  memcpy(blob, &_eeprom, sizeof(_eeprom));
+  if (configuration.size > 0)
+    memcpy(blob + sizeof(_eeprom), configuration.data, configuration.size);
+
+  JsonObject jsonBinary = jsonReply["binary"].to<JsonObject>();
+  jsonBinary["version"] = configuration.version;
+  jsonBinary["size"]    = size;
+  jsonBinary["crc"]     = crc32(blob, size);
+
+  encodeBase64(blob, size, text);
+  jsonBinary["data"] = text;
+
+  sendJSON(transport, reply);
+}
+
+// Write an image from readConfigurationBinary() to the EEPROM and reboot; a
+// different configuration version is converted by handleEEPROM() at startup.
+void V2Device::writeConfigurationBinary(V2MIDI::Transport* transport, JsonObject jsonBinary) {
+  const char*    status = "invalidData";
+  const uint32_t size   = jsonBinary["size"];
+  const uint32_t crc    = jsonBinary["crc"];
+  const char*    data   = jsonBinary["data"];
+
+  // The data is decoded into the SystemExclusive buffer; the reply is built
+  // after the data is written.
+  if (data && size > sizeof(EEPROM::Header) && size <= V2Base::Memory::EEPROM::getSize() &&
+      (size + 2) / 3 * 3 <= _sysexSize && strlen(data) == (size + 2) / 3 * 4) {
+    uint8_t* blob = getSystemExclusiveBuffer();
+    if (V2Base::Text::Base64::decode((const uint8_t*)data, blob) == size) {
+      const EEPROM::Header* header = (const EEPROM::Header*)blob;
+      if (crc32(blob, size) != crc)
+        status = "crcMismatch";
+
+      else if (header->magic == _eeprom.header.magic && header->size < size) {
+        writeEEPROM(0, blob, size);
+        status = "success";
+      }
+    }
+  }
+
+  JsonDocument reply(&jsonAllocator);
+  JsonObject   jsonReply = reply["com.versioduo.device"].to<JsonObject>();
+  jsonReply["token"]     = _boot.id;
+  jsonReply["status"]    = status;
+  sendJSON(transport, reply);
+
+  if (strcmp(status, "success") != 0)
+    return;
+
+  flushReply();
+  delay(100);
+  V2Base::Memory::Firmware::reboot();
+}
+
+// Write a packet into a flash region provided by the device. The packets are the
+// same as for "writeFirmware"; the final one carries the hash of the entire data.
+void V2Device::writeRegion(V2MIDI::Transport* transport,
+                           JsonObject         jsonRegion,
+                           const char*        data,
+                           uint32_t           dataLen,
+                           bool               raw) {
+  if (!jsonRegion)
+    return;
+
+  const uint8_t id     = jsonRegion["id"];
+  Storage*      region = getRegion(id);
+  if (!region) {
+    sendFirmwareStatus(transport, "invalidRegion", "region");
+    return;
+  }
+
+  const uint32_t offset = jsonRegion["offset"];
+  if (offset % V2Base::Memory::Flash::getBlockSize() != 0 || offset >= region->getSize()) {
+    sendFirmwareStatus(transport, "invalidOffset", "region");
+    return;
+  }
+
+  // The data is decoded into the region's block in RAM, which is written
+  // to the flash.
+  uint32_t blockLen;
+  if (!region->decode(offset, data, dataLen, raw, &blockLen)) {
+    sendFirmwareStatus(transport, "invalidData", "region");
+    return;
+  }
+
+  // Request the next packet before the block is written, like the firmware
+  // update.
+  const char* hash = jsonRegion["hash"];
+  if (!hash) {
+    sendFirmwareStatus(transport, "success", "region");
+    flushReply();
+  }
+
+  led.setBrightness(0.3);
+  region->flush();
+  led.setBrightness(0.1);
+
+  if (!hash)
+    return;
+
+  char h[41];
+  V2Base::Memory::Firmware::calculateHash(region->getStart(), offset + blockLen, h);
+  if (strcmp(h, hash) != 0) {
+    sendFirmwareStatus(transport, "hashMismatch", "region");
+    return;
+  }
+
+  handleRegion(id, offset + blockLen);
+  sendFirmwareStatus(transport, "success", "region");
 }
 
 bool V2Device::idle() {
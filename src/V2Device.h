@@ -3,11 +3,46 @@
 
 #pragma once
 
+// Optional features, all enabled by default. A product can remove the ones it
+// does not use with a compiler flag, e.g. -DV2DEVICE_LINK=0.
+//
+// The firmware update; "writeFirmware", "getFirmwareProgress", "relayFirmware".
+#ifndef V2DEVICE_FIRMWARE
+#define V2DEVICE_FIRMWARE 1
+#endif
+
+// The V2Link connection, the children of the device and their statistics.
+#ifndef V2DEVICE_LINK
+#define V2DEVICE_LINK 1
+#endif
+
+// The statistics of the serial MIDI port.
+#ifndef V2DEVICE_SERIAL
+#define V2DEVICE_SERIAL 1
+#endif
+
+// The hardware revision read from the PIN_REVISION pins.
+#ifndef V2DEVICE_REVISION
+#define V2DEVICE_REVISION 1
+#endif
+
+// The MIDI packet, clock, request latency, memory and reply size statistics.
+#ifndef V2DEVICE_STATISTICS
+#define V2DEVICE_STATISTICS 1
+#endif
+
+// Escape non-ASCII characters in replies; without it they are replaced by '?'.
+#ifndef V2DEVICE_UNICODE
+#define V2DEVICE_UNICODE 1
+#endif
+
 #define ARDUINOJSON_USE_DOUBLE 0
 #include <ArduinoJson.h>
 #include <V2Base.h>
 #include <V2LED.h>
+#if V2DEVICE_LINK
 #include <V2Link.h>
+#endif
 #include <V2MIDI.h>
 
 class V2Device : public V2MIDI::Port {
@@ -57,6 +92,16 @@ public:
 
     // A specific hardware revision number encoded with GPIO pins connected to ground.
     uint8_t revision{};
+
+    // Connect USB as early as possible, read the revision after that; the revision
+    // is not available in handleInit(). The firmware hash is calculated with the
+    // first "getAll" request, which takes ~80ms longer.
+    bool fastBoot{};
+
+    // The percentage of the SystemExclusive buffer the "getAll" reply may use
+    // before a warning is reported in system.reply. The report is added only if
+    // the request contains "report": true.
+    uint8_t replyBudget{90};
   } system;
 
   // Custom USB IDs, initialized with the board specified values.
@@ -72,8 +117,8 @@ public:
       // The default number of ports
       uint8_t standard{1};
 
-      // The number of ports to enable when 'rebootWithPorts' is called
-      // to gain access to the children devices.
+      // The number of ports to enable when 'rebootWithPorts' or 'reconnectWithPorts'
+      // is called to gain access to the children devices.
       uint8_t access{};
       bool    enableAccess{};
 
@@ -84,9 +129,52 @@ public:
     V2MIDI::USBDevice midi{};
   } usb;
 
+#if V2DEVICE_LINK
   V2Link* link{};
+#endif
 
+#if V2DEVICE_SERIAL
   V2MIDI::SerialDevice* serial{};
+#endif
+
+  // The number of requests per second, and the number of requests which can
+  // arrive at once; a rate of 0 disables the limit.
+  struct RequestRate {
+    uint16_t rate;
+    uint8_t  burst;
+  };
+
+  // The rate of a single method, across all transports.
+  struct MethodRate {
+    const char* method;
+    RequestRate rate;
+  };
+
+  // Limits for incoming requests, to bound the time spent in the request handler.
+  // Requests exceeding a limit are rejected and counted in system.requests.
+  struct {
+    // The depth of nested objects and arrays.
+    uint8_t nesting{10};
+
+    // The number of object members and array elements in the entire request.
+    uint16_t members{512};
+
+    // The length of a string; the values of "data" members, the payload of the
+    // firmware, region and binary configuration packets, are not included.
+    uint16_t string{1024};
+
+    // Requests which took longer to parse are counted in system.requests.slow;
+    // they are still handled, the parser cannot be interrupted.
+    uint32_t usec{50 * 1000};
+
+    // The requests of every transport.
+    RequestRate transport{100, 20};
+
+    // Methods with their own limit, in addition to the limit of the transport.
+    // "getAll" builds and sends the entire state of the device; the device can
+    // add its own expensive methods to the empty entries.
+    MethodRate methods[4]{{"getAll", {10, 5}}};
+  } limits;
 
   // Built-in LED.
   V2LED::Basic led;
@@ -96,8 +184,55 @@ public:
     uint16_t version; // A different version calls handleEEPROM() to possibly convert from.
     uint16_t size;
     void*    data;
+    uint8_t  presets; // The number of copies of the data stored in the EEPROM.
   } configuration{};
 
+  // Configuration data which does not fit into the EEPROM, stored in a flash region
+  // reserved by the device, e.g. with the linker script. The region needs to be aligned
+  // to the flash block size. Reads of unmodified blocks access the flash directly;
+  // a block is copied to RAM when it is modified, and written back with flush().
+  class Storage {
+  public:
+    constexpr Storage(uint32_t start, uint32_t size) : _start(start), _size(size) {}
+
+    uint32_t getStart() {
+      return _start;
+    }
+
+    uint32_t getSize() {
+      return _size;
+    }
+
+    bool read(uint32_t offset, void* data, uint32_t size);
+    bool write(uint32_t offset, const void* data, uint32_t size);
+
+    // Write the modified block to the flash. It is called by writeConfiguration().
+    void flush();
+
+    // Reset the entire region to 0xff.
+    void erase();
+
+  private:
+    friend class V2Device;
+
+    const uint32_t _start;
+    const uint32_t _size;
+
+    // The modified block in RAM.
+    struct {
+      uint32_t* data;
+      uint32_t  offset;
+      bool      dirty;
+    } _block{};
+
+    void load(uint32_t offset);
+
+    // Decode the data of a "writeRegion" packet directly into the block in RAM.
+    bool decode(uint32_t offset, const char* data, uint32_t dataLen, bool raw, uint32_t* len);
+  };
+
+  Storage* storage{};
+
   // The maximum system exclusive message size. It needs to carry at least the firmware
   // update packet of 8k bytes -> base64 encoded -> wrapped in a JSON object -> ~12kb.
   //
@@ -115,6 +250,12 @@ public:
   // Return if there is pending work, e.g. queued messages.
   bool idle();
 
+  // Count a message which could not be sent because the queue of the transport
+  // was full. The replies and relayed packets of the library are counted; the
+  // device calls it when a send of its own messages fails. Exported with the
+  // statistics of the transport.
+  void countDropped(V2MIDI::Transport* transport);
+
   // Wait for interrupts, goes into sleep mode IDLE. The system tick will wake it
   // up at least once every millisecond.
   void sleep() {
@@ -124,6 +265,27 @@ public:
   // Write the configuration to the EEPROM.
   void writeConfiguration();
 
+  // Store the current configuration data in a preset slot.
+  bool storePreset(uint8_t preset);
+
+  // Copy a preset slot to the configuration data and call handlePreset(); the EEPROM
+  // is not written. It can be called from handleProgramChange().
+  bool recallPreset(uint8_t preset);
+
+#if V2DEVICE_LINK
+  // A SystemExclusive message received from the child device at the given position,
+  // the USB port / virtual cable number the host would use to reach it. Returns true
+  // if the message was a reply to a request of the parent and has been consumed.
+  bool dispatchChild(uint8_t position, const uint8_t* buffer, uint32_t len);
+#endif
+
+  // A message from a transport with 8-bit SystemExclusive messages, e.g. SysEx8
+  // of a USB MIDI 2.0 (UMP) endpoint. The payload carries the manufacturer ID and
+  // the JSON request; the data of a firmware or region packet follows a NUL byte,
+  // without base64 encoding. The transport receives all replies as 8-bit messages,
+  // sent with sendSystemExclusive8(), the JSON is not escaped.
+  void dispatchSystemExclusive8(V2MIDI::Transport* transport, const uint8_t* buffer, uint32_t len);
+
 protected:
   // Called after reading the configuration from the EEPROM, before USB is initialized.
   virtual void handleInit() {}
@@ -132,8 +294,8 @@ protected:
 
   virtual void handleLoop() {}
 
-  // Called when updateConfiguration() is called. Parses the config and writes it to
-  // the EEPROM.
+  // Called for "writeConfiguration" and "patchConfiguration"; the latter passes only
+  // the changed members. Parses the config, the EEPROM is written afterwards.
   virtual void importConfiguration(JsonObject json) {}
 
   // The human readable device properties, e.g. name, vendor, product, description.
@@ -158,9 +320,42 @@ protected:
   // The notes and controllers the device sends out.
   virtual void exportOutput(JsonObject json) {}
 
+  // Flash regions which can be written by the host with "writeRegion", using the same
+  // packets as the firmware update, e.g. sample data, wavetables or LED maps.
+  virtual Storage* getRegion(uint8_t id) {
+    return NULL;
+  }
+
+  // Called after the data of a region has been written and its hash verified.
+  virtual void handleRegion(uint8_t id, uint32_t size) {}
+
+  // Called after recallPreset() has replaced the configuration data.
+  virtual void handlePreset(uint8_t preset) {}
+
+#if V2DEVICE_LINK
+  // Send a SystemExclusive message to the child device at the given position, the
+  // same route a message from the host's USB port with this number would take.
+  // The buffer is only valid during the call, the message needs to be copied.
+  virtual bool sendToChild(uint8_t position, const uint8_t* buffer, uint32_t len) {
+    return false;
+  }
+#endif
+
+  // Send the payload of an 8-bit message, without the framing of a MIDI 1.0
+  // SystemExclusive message. It needs to be provided by the transport.
+  virtual bool sendSystemExclusive8(V2MIDI::Transport* transport, const uint8_t* buffer, uint32_t len) {
+    return false;
+  }
+
   // Read the binary configuration from an different/older version.
   virtual void handleEEPROM(uint16_t version, const void* data, uint32_t size) {}
 
+#if V2DEVICE_STATISTICS
+  // Timestamps the incoming clock to export its tempo and jitter. A device which
+  // handles the clock itself needs to call V2Device::handleClock().
+  void handleClock(Clock clock) override;
+#endif
+
 private:
   struct EEPROM {
     const struct Header {
@@ -189,20 +384,236 @@ private:
     } usb;
   } _eeprom;
 
+  // The preset slots follow the configuration data in the EEPROM, every slot
+  // starts with a header.
+  struct Preset {
+    uint16_t magic;
+    uint16_t version;
+    uint32_t size;
+  };
+
   struct {
     uint32_t id;
+
+    // The duration of the steps in begin(); 'start' is the time since power-on.
+    struct {
+      uint32_t start;
+      uint32_t userPage;
+      uint32_t hash;
+      uint32_t revision;
+      uint32_t eeprom;
+      uint32_t init;
+      uint32_t usb;
+    } usec;
   } _boot{};
 
   struct {
     char hash[41];
   } _firmware{};
 
+  // The time it takes to handle a request, measured from the receipt of the
+  // SystemExclusive message to the start of sending the reply.
+  struct {
+    // The receipt of the current request.
+    uint32_t usec;
+
+#if V2DEVICE_STATISTICS
+    // Power-of-two buckets; the first one counts replies sent within 128 usec,
+    // the last one all replies which took longer than the previous buckets.
+    uint32_t histogram[12];
+
+    // A request is handled and has not replied yet; replies sent from loop(),
+    // like timeouts of the children, are not recorded.
+    bool active;
+#endif
+
+    // The timestamps of the last "ping" request.
+    struct {
+      uint32_t nonce;
+      uint32_t receive;
+      uint32_t send;
+      uint32_t drain;
+      bool     pending;
+    } ping;
+  } _latency{};
+
+#if V2DEVICE_STATISTICS
+  // The intervals between the last incoming clock ticks.
+  struct {
+    uint32_t usec;
+    uint32_t intervals[48];
+    uint8_t  index;
+    uint8_t  count;
+    uint32_t dropout;
+  } _clock{};
+#endif
+
+#if V2DEVICE_LINK
+  // The pending "getChildren" request.
+  struct {
+    V2MIDI::Transport* transport;
+    uint32_t           usec;
+    uint16_t           pending;
+    JsonDocument*      json;
+  } _children{};
+#endif
+
+#if V2DEVICE_FIRMWARE && V2DEVICE_LINK
+  // The firmware update of children. The host's "relayFirmware" packets are
+  // forwarded to all children running a firmware with the same id.
+  struct {
+    V2MIDI::Transport* transport;
+    uint32_t           usec;
+    bool               select;
+    uint16_t           children;
+    uint16_t           pending;
+    uint32_t           tokens[16];
+    const char*        status[16];
+  } _relay{};
+#endif
+
+  // Rejected requests, and requests dropped by the rate limits.
+  struct {
+    struct {
+      uint32_t nesting;
+      uint32_t members;
+      uint32_t string;
+    } rejected;
+
+    uint32_t slow;
+
+    struct {
+      uint32_t usb;
+      uint32_t serial;
+      uint32_t other;
+      uint32_t methods[4];
+    } dropped;
+  } _requests{};
+
+#if V2DEVICE_STATISTICS
+  // The outgoing queues. A queue which does not drain for longer than 100
+  // msec is counted as a stall; the host is not reading.
+  struct Output {
+    uint32_t usec;
+    uint32_t stalls;
+    uint32_t longest;
+    uint32_t dropped;
+  };
+
+  struct {
+    // The SystemExclusive replies; 'largest' is the length of the largest
+    // reply, the reply buffer holds a single message.
+    struct {
+      Output   queue;
+      uint32_t largest;
+      bool     queued;
+    } reply;
+
+    Output usb;
+    Output serial;
+    Output plug;
+    Output socket;
+    Output other;
+  } _output{};
+#endif
+
+  // The token buckets of the request rates, in millionths of a request. The
+  // host is told that the device is busy at most once per token interval;
+  // 'busy' is the time of the last message.
+  struct Bucket {
+    uint32_t usec;
+    uint32_t tokens;
+    uint32_t busy;
+  };
+
+  struct {
+    Bucket usb;
+    Bucket serial;
+    Bucket other;
+    Bucket methods[4];
+  } _buckets{};
+
+#if V2DEVICE_STATISTICS
+  // The peak stack and JSON document usage, recorded for every request method.
+  struct {
+    char     method[24];
+    uint32_t stack;
+    uint32_t heap;
+    struct {
+      char     name[24];
+      uint32_t stack;
+      uint32_t heap;
+    } methods[12];
+  } _ram{};
+#endif
+
+  // Incremented with every change of the configuration or the channel.
+  struct {
+    uint32_t sequence;
+  } _state{};
+
+  // The USB device is detached, and will be attached again.
+  struct {
+    uint32_t usec;
+  } _reconnect{};
+
+  // The transport which has sent 8-bit messages.
+  V2MIDI::Transport* _sysex8{};
+
   V2Base::Timer::Periodic _ledTimer;
 
-  void sendReply(V2MIDI::Transport* transport);
-  void sendFirmwareStatus(V2MIDI::Transport* transport, const char* status);
+  void addConfiguration(JsonObject config);
+  void importUSB(JsonObject jsonUsb);
+  void hashFirmware();
+  void readRevision();
+  void attachUSB();
+#if V2DEVICE_LINK
+  void requestChildren(V2MIDI::Transport* transport);
+  void sendChildren();
+#endif
+#if V2DEVICE_FIRMWARE && V2DEVICE_LINK
+  void selectRelayChildren(V2MIDI::Transport* transport, const char* id, const char* board);
+  void relayFirmware(V2MIDI::Transport* transport, JsonDocument& json, const char* data, uint32_t dataLen, bool raw);
+  void sendRelayStatus();
+#endif
+  void sendStatus(V2MIDI::Transport* transport, JsonObject keys);
+  void sendJSON(V2MIDI::Transport* transport, const JsonDocument& json);
+  void sendRequestReply(V2MIDI::Transport* transport, uint32_t len);
+#if V2DEVICE_STATISTICS
+  void sampleOutput(Output* output, bool busy);
+  void addOutput(JsonObject json, const Output* output);
+#endif
+  void sendPing(V2MIDI::Transport* transport, uint32_t nonce);
+  void sendReply(V2MIDI::Transport* transport, bool report = false);
+#if V2DEVICE_STATISTICS
+  void addReplyBudget(JsonDocument& json);
+#endif
+  void flushReply();
+  void readConfigurationBinary(V2MIDI::Transport* transport);
+  void writeConfigurationBinary(V2MIDI::Transport* transport, JsonObject jsonBinary);
+  void sendFirmwareStatus(V2MIDI::Transport* transport, const char* status, const char* name = "firmware");
+  void writeRegion(V2MIDI::Transport* transport,
+                   JsonObject         jsonRegion,
+                   const char*        data,
+                   uint32_t           dataLen,
+                   bool               raw);
   void handleSystemExclusive(V2MIDI::Transport* transport, const uint8_t* buffer, uint32_t len) override;
+  void handleMessage(V2MIDI::Transport* transport,
+                     const uint8_t*     text,
+                     uint32_t           textLen,
+                     const char*        data,
+                     uint32_t           dataLen,
+                     bool               raw);
+  void handleRequest(V2MIDI::Transport* transport,
+                     const uint8_t*     text,
+                     uint32_t           textLen,
+                     const char*        data,
+                     uint32_t           dataLen,
+                     bool               raw);
+  bool checkRequest(const uint8_t* text, uint32_t len);
+  bool admitRequest(V2MIDI::Transport* transport, const char* method);
   bool readEEPROM(bool dryrun = false);
+  uint32_t getPresetOffset(uint8_t preset);
 };
 
 // Global variable, set with V2DEVICE_METADATA()
@@ -0,0 +1,100 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2022
+// SPDX-License-Identifier: Apache-2.0
+
+// The base64 decoder of the firmware and region packets. It has no dependencies,
+// the host tests include it directly.
+#pragma once
+
+#include <cstdint>
+
+namespace V2DeviceBase64 {
+// The value of a base64 character; invalid characters have the high bit set.
+static const uint8_t table[256]{
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x3e, 0x80, 0x80, 0x80, 0x3f,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+  0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+};
+
+// Decode the data into the word-aligned block of 'blockSize' bytes, it needs
+// to fit. Groups of 16 characters are decoded into three 32 bit words.
+static inline bool decode(const char* data, uint32_t dataLen, uint32_t* block, uint32_t blockSize, uint32_t* len) {
+  if (!data || dataLen % 4 != 0)
+    return false;
+
+  // The decoded length, without the padding of the last group.
+  uint32_t size = dataLen / 4 * 3;
+  if (dataLen > 0 && data[dataLen - 1] == '=')
+    size--;
+  if (dataLen > 0 && data[dataLen - 2] == '=')
+    size--;
+
+  if (size > blockSize)
+    return false;
+
+  const uint8_t* text  = (const uint8_t*)data;
+  uint32_t*      words = block;
+
+  // Leave the last group, it might contain padding.
+  uint32_t i = 0;
+  for (; i + 16 < dataLen; i += 16) {
+    uint32_t triple[4];
+    uint8_t  invalid = 0;
+
+    for (uint8_t k = 0; k < 4; k++) {
+      const uint8_t a = table[text[i + k * 4]];
+      const uint8_t b = table[text[i + k * 4 + 1]];
+      const uint8_t c = table[text[i + k * 4 + 2]];
+      const uint8_t d = table[text[i + k * 4 + 3]];
+      invalid |= a | b | c | d;
+      triple[k] = a << 18 | b << 12 | c << 6 | d;
+    }
+
+    if (invalid & 0x80)
+      return false;
+
+    // Little-endian byte order of the twelve decoded bytes.
+    *words++ = (triple[0] >> 16 & 0xff) | (triple[0] >> 8 & 0xff) << 8 | (triple[0] & 0xff) << 16 |
+               (triple[1] >> 16 & 0xff) << 24;
+    *words++ = (triple[1] >> 8 & 0xff) | (triple[1] & 0xff) << 8 | (triple[2] >> 16 & 0xff) << 16 |
+               (triple[2] >> 8 & 0xff) << 24;
+    *words++ = (triple[2] & 0xff) | (triple[3] >> 16 & 0xff) << 8 | (triple[3] >> 8 & 0xff) << 16 |
+               (triple[3] & 0xff) << 24;
+  }
+
+  uint8_t* bytes = (uint8_t*)words;
+  for (; i < dataLen; i += 4) {
+    const uint8_t a = table[text[i]];
+    const uint8_t b = table[text[i + 1]];
+    const uint8_t c = text[i + 2] == '=' ? 0 : table[text[i + 2]];
+    const uint8_t d = text[i + 3] == '=' ? 0 : table[text[i + 3]];
+    if ((a | b | c | d) & 0x80)
+      return false;
+
+    // Padding is only allowed at the end.
+    if (i + 4 < dataLen && (text[i + 2] == '=' || text[i + 3] == '='))
+      return false;
+
+    *bytes++ = a << 2 | b >> 4;
+    if (text[i + 2] != '=')
+      *bytes++ = b << 4 | c >> 2;
+    if (text[i + 3] != '=')
+      *bytes++ = c << 6 | d;
+  }
+
+  *len = bytes - (uint8_t*)block;
+  return true;
+}
+};